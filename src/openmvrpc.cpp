@@ -26,9 +26,132 @@
 // Master --> Slave magic DATA value, CRC
 // Master <-- Slave magic DATA ack, n-byte payload, CRC
 //
+// Fast Call (after negotiate() agrees on RPC_CAPABILITY_FAST_CALL):
+// Master --> Slave magic FAST COMMAND value, cmd, payload len, CRC + magic DATA value, n-byte payload, CRC
+// Master <-- Slave magic FAST RESULT value, length, CRC + magic DATA value, n-byte payload, CRC
+// Commands that do not fit either buffer use the legacy exchange. A result that does not fit the
+// slave's buffer comes back as the FAST (or PIPELINED) RESULT header alone and the call fails.
+//
+// Pipelined Call (after negotiate() agrees on RPC_CAPABILITY_PIPELINE):
+// Master --> Slave magic PIPELINED COMMAND value, cmd, UINT16 payload len, UINT16 seq, CRC + magic DATA value, n-byte payload, CRC
+// ... (up to the pipeline depth of further commands)
+// Master <-- Slave magic PIPELINED RESULT value, UINT16 length, UINT16 seq, CRC + magic DATA value, n-byte payload, CRC
+// ... (one result per command in order)
+//
+// Batch Call (after negotiate() agrees on RPC_CAPABILITY_BATCH):
+// The reserved "__rpc_batch" command carries a list of cmd, UINT32 len, n-byte args entries
+// and returns a list of UINT32 len, n-byte result entries in the same order.
+//
+// Chunked Transfer (after negotiate() agrees on RPC_CAPABILITY_CHUNKED):
+// Payloads that do not fit the smaller of both buffers replace the legacy data packet with
+// buffer sized chunks that each carry their offset and CRC. Lost chunks are simply resent.
+// Master --> Slave magic COMMAND CHUNK value, UINT32 offset, n-byte payload, CRC
+// Master <-- Slave magic COMMAND CHUNK ack, UINT32 offset, CRC
+// ...
+// Master --> Slave magic RESULT CHUNK value, UINT32 offset, CRC
+// Master <-- Slave magic RESULT CHUNK ack, UINT32 offset, n-byte payload, CRC
+// ...
+// Master --> Slave magic RESULT CHUNK value, UINT32 offset == length, CRC (done)
+//
+// Selective Retransmission (after negotiate() agrees on RPC_CAPABILITY_NAK):
+// A corrupt data packet is answered with a magic NAK + CRC packet sized like the packet the
+// receiver was otherwise going to send (4 bytes in place of the DATA ack, 8 bytes in place of
+// a fast result header and 12 bytes in place of the next command header). The sender then
+// resends only the data packet, or in the slave's case its last result, keeping header state.
+//
+// Fragments (after negotiate() agrees on RPC_CAPABILITY_FRAGMENTS):
+// A legacy data packet that would span more than one fragment is instead sent as up to 32
+// fragments that fill whole transport frames (see _mtu). Each fragment is UINT16 index,
+// n-byte payload, CRC. The receiver answers every round with magic FRAGMENT value, UINT32
+// bitmap of missing fragments, CRC and the sender resends only those until the bitmap is 0.
+//
+// Ack-less Calls (after negotiate() agrees on RPC_CAPABILITY_ACKLESS):
+// Only offered when both transports set RPC_TRANSPORT_RELIABLE. Calls use the fast call frames
+// but the master writes its frame once and reads the result once without polling or resending.
+// RPC_CAPABILITY_NO_CRC is only offered when both set RPC_TRANSPORT_INTEGRITY and then received
+// CRCs are no longer checked. CRCs are still sent so the frames stay the same.
+//
+// Compression (after negotiate() agrees on RPC_CAPABILITY_COMPRESSION):
+// Legacy and fast data packets that shrink are sent LZF compressed with the top bit of the
+// length in the command or result header set. Both sides may set the same static dictionary
+// with set_compression_dictionary() before negotiate() to seed matches for repeated strings.
+//
+// Delta Results (after negotiate() agrees on RPC_CAPABILITY_DELTA):
+// The reserved "__rpc_delta" command carries cmd, UINT32 tag of the master's last result and
+// the args. Results are UINT8 0 followed by the full result or, when the slave kept the same
+// result for cmd (see register_delta_buffer()), UINT8 1, UINT32 tag, UINT32 length and an XOR
+// run length delta against it. Tags are a CRC-32 over a result and its UINT32 length.
+//
+// Conditional Calls (after negotiate() agrees on RPC_CAPABILITY_CONDITIONAL):
+// The reserved "__rpc_conditional" command carries cmd, UINT32 tag of the master's last result
+// and the args. If the new result has the same tag the slave sends a result header with the
+// NOT MODIFIED length (0x40000000) and skips the data phase (a fast result frame is just that header).
+//
+// Events (after negotiate() agrees on RPC_CAPABILITY_EVENTS):
+// The slave queues cmd, UINT32 len, n-byte payload entries with push_event(). The reserved
+// "__rpc_events" command carries a UINT32 running total of events the master has received. The
+// slave drops the ones that total covers and it has not dropped yet, then returns as many queued
+// entries as fit. Each poll_events() is one fetch so the last entries returned are dropped by the
+// next one. An optional event pin is held high while events are queued so the master only has to
+// fetch when it is.
+//
+// Subscriptions (after negotiate() agrees on RPC_CAPABILITY_SUBSCRIBE):
+// The reserved "__rpc_subscribe" command carries cmd, UINT32 period in ms and the args and
+// returns UINT8 1 if cmd is registered. The master then runs stream_reader() and the slave
+// runs stream_writer() with the results of cmd every period until the stream stops.
+//
+// Stream Channels (stream_reader_channels() and stream_writer_channels()):
+// The reader sends one magic CHANNEL SETUP value, UINT32 channel << 24 | queue depth, CRC packet
+// per channel. Frames are magic CHANNEL FRAME value, UINT32 channel << 24 | length, CRC followed
+// by the payload and credits are UINT8 channel, UINT8 LFSR of that channel.
+//
+// Duplex Streams (stream_duplex()):
+// Both sides send one magic DUPLEX SETUP value, UINT32 channel << 24 | queue depth, CRC packet
+// per channel (0 without a reader) and then read the peer's. Frames are magic DUPLEX FRAME
+// value, UINT32 channel << 24 | length, CRC followed by the payload and credits are magic
+// DUPLEX CREDIT value, UINT32 channel << 24 | count, CRC so both can share one direction.
+//
+// Resumable Streams (set_stream_resumable()):
+// The reader sends a magic RESUME SETUP value, UINT32 queue depth, CRC packet. Frames are magic
+// RESUME FRAME value, UINT16 sequence, UINT16 payload CRC, UINT32 length, UINT16 writer window,
+// UINT16 frames dropped, CRC followed by the payload. Acks are magic RESUME ACK value, UINT16 next
+// sequence, UINT16 resume << 15 | window, CRC and are cumulative. The reader sends one once half of
+// the writer window has arrived, which is when the writer starts waiting for one, so a single ack
+// returns many credits. On a corrupt or missing frame the reader scans for the next valid header,
+// drops frames until the one it expects and sends an ack with resume set. The writer then reuses
+// that sequence for fresh frames from the callback and adds the frames it sent past it to frames
+// dropped, so lost frames are counted rather than resent. The session only ends when there is no
+// progress for the read or write timeout. The setup queue depth is the largest window. The reader
+// grows the window by the frames it could have drained while it waited for one and shrinks it by
+// one after four frames that were already there, so it settles near the bandwidth delay product.
+//
+// Latest Only Streams (set_stream_latest_only()):
+// A resumable stream whose setup is UINT32 1 << 31 | 1. While the writer waits for its credit it
+// checks for a whole ack without blocking and otherwise fetches a newer frame, dropping the one it held.
+// The number dropped goes in the next frame header.
+//
+// Coalesced Streams (set_stream_coalescing()):
+// Resumable frames whose length has the top bit set hold a batch of UINT16 length, payload
+// records. Records too big for a batch go out alone as plain frames.
+//
+// Stream Calls (rpc_master::stream_call()):
+// While a resumable stream runs the reader may send a magic STREAM CALL value, UINT32 length, CRC
+// packet on the ack path followed by cmd, UINT16 id, args, UINT16 CRC. The writer checks for one
+// before every frame (on transports that cannot tell bytes are waiting only while it waits for an
+// ack) and answers with a magic STREAM RESULT value, UINT32 cmd, UINT32 length, UINT16 payload CRC,
+// UINT16 id, CRC header followed by the result before it sends its next frame. Results carry no
+// sequence and are not acked. Only user callbacks can be called this way.
+//
+// Capabilities are negotiated by calling the reserved "__rpc_capabilities" command with the
+// legacy exchange. Slaves that do not know it return an empty result so the master falls back.
+// The master sends its capabilities, buffer length, MTU and dictionary id and the slave replies
+// with the same.
+//
 
 using namespace openmv;
 
+#define LZ_HASH_LEN 64 // Must be a power of 2.
+
 static unsigned long unpack_unsigned_long(uint8_t *data)
 {
     unsigned long ret;
@@ -72,10 +195,8 @@ static const uint16_t __crc_16_table[256] =
     0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
 };
 
-uint16_t rpc::__crc_16(uint8_t *data, size_t size)
+uint16_t rpc::__crc_16(uint8_t *data, size_t size, uint16_t crc)
 {
-    uint16_t crc = 0xFFFF;
-
     // for (size_t i = 0; i < size; i++) {
     //    crc ^= data[i] << 8;
     //    for (size_t j = 0; j < 8; j++) crc = (crc << 1) ^ ((crc & 0x8000) ? 0x1021 : 0x0000);
@@ -153,175 +274,1921 @@ rpc::rpc(uint8_t *buff, size_t buff_len)
     _buff = buff;
     _buff_len = buff_len;
     _stream_writer_queue_depth_max = 255;
+    _pipeline_depth_max = 255;
+    _mtu = 0;
+    _peer_mtu = 0;
+    _transport = 0;
+    _skip_crc = false;
+    _dictionary = NULL;
+    _dictionary_len = 0;
+    _dictionary_shared = false;
+    __stream_resumable = false;
+    __stream_window = 0;
+    __stream_latest_only = false;
+    __stream_dropped = 0;
+    __stream_batch_len = 0;
+    __stream_batch_delay = 0;
+    __stream_chunk_callback = NULL;
+    __stream_pace_bytes = 0;
+    __stream_pace_frames = 0;
+    __stream_pace_burst = 0;
+    __stream_active = false;
+    __stream_call_command = 0;
+    __stream_call_id = 0;
+    __stream_call_callback = NULL;
+    __stream_begin();
+}
+
+bool rpc::_check_packet(uint16_t magic_value, uint8_t *buff, size_t size)
+{
+    uint16_t magic = buff[0] | (buff[1] << 8);
+    uint16_t crc = buff[size - 2] | (buff[size - 1] << 8);
+    return (magic == magic_value) && (_skip_crc || (crc == __crc_16(buff, size - 2)));
 }
 
 bool rpc::_get_packet(uint16_t magic_value, uint8_t *buff, size_t size, unsigned long timeout)
 {
     if (!get_bytes(buff, size, timeout)) return false;
-    uint16_t magic = buff[0] | (buff[1] << 8);
-    uint16_t crc = buff[size - 2] | (buff[size - 1] << 8);
-    return (magic == magic_value) && (crc == __crc_16(buff, size - 2));
+    return _check_packet(magic_value, buff, size);
 }
 
 void rpc::_set_packet(uint8_t *buff, uint16_t magic_value, uint8_t *data, size_t size)
 {
+    if (size) memmove(buff + 2, data, size); // data may already live in buff.
     buff[0] = magic_value;
     buff[1] = magic_value >> 8;
-    if (size) memcpy(buff + 2, data, size);
     uint16_t crc = __crc_16(buff, size + 2);
     buff[size + 2] = crc;
     buff[size + 3] = crc >> 8;
 }
 
-void rpc::stream_reader(rpc_stream_reader_callback_t callback, unsigned long queue_depth, unsigned long read_timeout)
+void rpc::set_stream_coalescing(size_t batch_len, unsigned long batch_delay)
+{
+    __stream_batch_len = min(batch_len, 0xFFFF);
+    __stream_batch_delay = batch_delay;
+}
+
+void rpc::set_stream_pacing(unsigned long bytes_per_second, unsigned long frames_per_second, unsigned long burst_ms)
+{
+    __stream_pace_bytes = bytes_per_second;
+    __stream_pace_frames = frames_per_second;
+    __stream_pace_burst = burst_ms;
+}
+
+unsigned long rpc::get_stream_bytes_per_second()
+{
+    unsigned long elapsed = __stream_last - __stream_start;
+    return elapsed ? ((((uint64_t) __stream_bytes) * 1000) / elapsed) : 0;
+}
+
+unsigned long rpc::get_stream_frames_per_second()
+{
+    unsigned long elapsed = __stream_last - __stream_start;
+    return elapsed ? ((((uint64_t) __stream_frames) * 1000) / elapsed) : 0;
+}
+
+void rpc::__stream_begin()
+{
+    __stream_start = __stream_last = millis();
+    __stream_bytes = __stream_frames = 0;
+    __stream_bytes_tat = __stream_frames_tat = micros();
+}
+
+void rpc::__stream_count(size_t size)
+{
+    __stream_last = millis();
+    __stream_bytes += size;
+    __stream_frames += 1;
+}
+
+// Each limit is a token bucket kept as the time at which it would be empty (the generic cell
+// rate algorithm). Sending waits until neither is more than the burst ahead of now.
+void rpc::__stream_pace(size_t size)
+{
+    unsigned long now = micros();
+    long ahead = max((long) (__stream_bytes_tat - now), (long) (__stream_frames_tat - now));
+    long wait = ahead - (long) (__stream_pace_burst * 1000);
+
+    if (wait > 0) {
+        delay(wait / 1000);
+        delayMicroseconds(wait % 1000);
+        now = micros();
+    }
+
+    if (((long) (__stream_bytes_tat - now)) < 0) __stream_bytes_tat = now;
+    if (((long) (__stream_frames_tat - now)) < 0) __stream_frames_tat = now;
+    if (__stream_pace_bytes) __stream_bytes_tat += (((uint64_t) size) * 1000000) / __stream_pace_bytes;
+    if (__stream_pace_frames) __stream_frames_tat += 1000000 / __stream_pace_frames;
+}
+
+void rpc::set_compression_dictionary(const uint8_t *dictionary, size_t dictionary_len)
+{
+    _dictionary = dictionary;
+    _dictionary_len = dictionary ? dictionary_len : 0;
+}
+
+// CRC-32 over the data followed by its UINT32 length. Tags stand in for whole results (see
+// RPC_CAPABILITY_CONDITIONAL and RPC_CAPABILITY_DELTA) so 16 bits are not enough. 0 means no tag.
+uint32_t rpc::_tag(const uint8_t *data, size_t size)
+{
+    if (!size) return 0;
+    const uint8_t length[4] = {(uint8_t) size, (uint8_t) (size >> 8), (uint8_t) (((uint32_t) size) >> 16),
+                               (uint8_t) (((uint32_t) size) >> 24)};
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (size_t i = 0; i < (size + sizeof(length)); i++) {
+        crc ^= (i < size) ? data[i] : length[i - size];
+        for (size_t j = 0; j < 8; j++) crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0x00000000);
+    }
+
+    crc = ~crc;
+    return crc ? crc : 1;
+}
+
+static size_t lz_hash(uint8_t *data)
+{
+    uint32_t v = data[0] | (data[1] << 8) | (((uint32_t) data[2]) << 16);
+    return (((uint32_t) (v * 2654435761UL)) >> 16) & (LZ_HASH_LEN - 1);
+}
+
+static bool lz_put_literals(uint8_t *data, size_t size, uint8_t *out, size_t *out_size, size_t out_max)
+{
+    for (size_t i = 0; i < size; i += 32) {
+        size_t n = min(size - i, 32);
+        if ((*out_size + n + 1) > out_max) return false;
+        out[(*out_size)++] = n - 1;
+        memcpy(out + *out_size, data + i, n);
+        *out_size += n;
+    }
+
+    return true;
+}
+
+// LZF style codec. A control byte below 32 starts a run of control + 1 literals. Otherwise its
+// top 3 bits are the match length - 2 (7 means an extra length byte follows) and its low 5 bits
+// and the next byte are the distance - 1 back into the output (or the shared dictionary).
+bool rpc::__lz_compress(uint8_t *data, size_t size, uint8_t *out, size_t out_max, size_t *out_size, size_t *gap)
+{
+    const uint8_t *dict = _dictionary_shared ? _dictionary : NULL;
+    size_t dict_len = dict ? _dictionary_len : 0;
+    uint16_t table[LZ_HASH_LEN];
+    size_t i = 0, literals = 0;
+    memset(table, 0, sizeof(table));
+    *out_size = 0;
+    *gap = 0;
+
+    // Positions count from the start of the dictionary and 0 marks an empty slot.
+    for (size_t v = 0; (v + 2) < dict_len; v++) table[lz_hash((uint8_t *) dict + v)] = v + 1;
+
+    while ((i + 2) < size) {
+        size_t v = dict_len + i;
+        size_t h = lz_hash(data + i);
+        size_t ref = table[h];
+        size_t len = 0;
+        table[h] = v + 1;
+
+        if (ref && ((v - (ref - 1)) <= 8192)) {
+            size_t len_max = min(size - i, 264);
+            for (size_t r = ref - 1; len < len_max; len++) {
+                if ((((r + len) < dict_len) ? dict[r + len] : data[r + len - dict_len]) != data[i + len]) break;
+            }
+        }
+
+        if (len < 3) {
+            i += 1;
+            if ((++literals) == 32) {
+                if (!lz_put_literals(data + i - literals, literals, out, out_size, out_max)) return false;
+                literals = 0;
+            }
+        } else {
+            size_t offset = v - ref, code = len - 2;
+            if (!lz_put_literals(data + i - literals, literals, out, out_size, out_max)) return false;
+            if ((*out_size + ((code < 7) ? 2 : 3)) > out_max) return false;
+            out[(*out_size)++] = (min(code, 7) << 5) | (offset >> 8);
+            if (code >= 7) out[(*out_size)++] = code - 7;
+            out[(*out_size)++] = offset;
+            literals = 0;
+            for (size_t j = 1; (j < len) && ((i + j + 2) < size); j++) table[lz_hash(data + i + j)] = v + j + 1;
+            i += len;
+        }
+
+        // How far the decoder's output gets ahead of its input when decoding in place.
+        if ((i - literals) > *out_size) *gap = max(*gap, (i - literals) - *out_size);
+    }
+
+    if (!lz_put_literals(data + i - literals, size - i + literals, out, out_size, out_max)) return false;
+    if (size > *out_size) *gap = max(*gap, size - *out_size);
+    return true;
+}
+
+bool rpc::__lz_decompress(uint8_t *data, size_t size, uint8_t *out, size_t *out_size)
+{
+    const uint8_t *dict = _dictionary_shared ? _dictionary : NULL;
+    size_t dict_len = dict ? _dictionary_len : 0;
+    size_t i = 0, o = 0;
+
+    // Output may share the buffer with the input as long as it never passes it.
+    while (i < size) {
+        size_t ctrl = data[i++];
+
+        if (ctrl < 32) {
+            size_t n = ctrl + 1;
+            if (((i + n) > size) || ((out + o) > (data + i))) return false;
+            memmove(out + o, data + i, n);
+            i += n;
+            o += n;
+        } else {
+            size_t len = ctrl >> 5;
+            if ((len == 7) && (i < size)) len += data[i++];
+            if (i >= size) return false;
+            size_t offset = ((ctrl & 0x1F) << 8) | data[i++];
+            len += 2;
+            if (((offset + 1) > (dict_len + o)) || ((out + o + len) > (data + i))) return false;
+            for (size_t r = dict_len + o - offset - 1; len; len--, r++) out[o++] = (r < dict_len) ? dict[r] : out[r - dict_len];
+        }
+    }
+
+    *out_size = o;
+    return true;
+}
+
+bool rpc::_compress(uint8_t **data, size_t *size, uint8_t *out, size_t peer_buff_len)
+{
+    uint8_t *end = _buff + _buff_len;
+    size_t out_size, gap;
+    if ((*size < 16) || ((_dictionary_len + *size) > 0xFFFF) || ((out + *size) > end)) return false;
+
+    // The encoder cannot write over its own input so input in the way moves to the end of _buff.
+    if ((*data < (out + *size)) && ((*data + *size) > out)) {
+        if ((end - *size) < (out + *size)) return false;
+        memmove(end - *size, *data, *size);
+        *data = end - *size;
+    }
+
+    // Only worth it if smaller and the peer can decode in place from the end of its buffer.
+    if (!__lz_compress(*data, *size, out, *size - 1, &out_size, &gap)) return false;
+    if ((out_size + gap + 4) > peer_buff_len) return false;
+    *data = out;
+    *size = out_size;
+    return true;
+}
+
+bool rpc::_decompress(uint8_t *data, size_t *size)
+{
+    uint8_t *in = _buff + _buff_len - *size;
+    memmove(in, data, *size);
+    return __lz_decompress(in, *size, data, size);
+}
+
+// Deltas are the XOR of the new and old result as runs. A control byte with the top bit set
+// skips (control & 0x7F) + 1 unchanged bytes and otherwise (control + 1) XOR bytes follow.
+// Bytes past the old result XOR against 0 and trailing unchanged bytes are left out.
+static bool xor_rle_encode(uint8_t *data, size_t size, uint8_t *base, size_t base_size,
+                           uint8_t *out, size_t out_max, size_t *out_size)
+{
+    *out_size = 0;
+
+    for (size_t i = 0; i < size;) {
+        size_t n = 0;
+        while (((i + n) < size) && (n < 128) && (data[i + n] == (((i + n) < base_size) ? base[i + n] : 0))) n++;
+
+        if (n) {
+            if ((i + n) == size) break;
+            if ((*out_size + 1) > out_max) return false;
+            out[(*out_size)++] = 0x80 | (n - 1);
+            i += n;
+            continue;
+        }
+
+        while (((i + n) < size) && (n < 128) && (data[i + n] != (((i + n) < base_size) ? base[i + n] : 0))) n++;
+        if ((*out_size + n + 1) > out_max) return false;
+        out[(*out_size)++] = n - 1;
+        for (; n; n--, i++) out[(*out_size)++] = data[i] ^ ((i < base_size) ? base[i] : 0);
+    }
+
+    return true;
+}
+
+static bool xor_rle_decode(uint8_t *data, size_t size, uint8_t *out, size_t out_size)
+{
+    for (size_t i = 0, o = 0; i < size;) {
+        size_t ctrl = data[i++], n = (ctrl & 0x7F) + 1;
+        if ((o + n) > out_size) return false;
+
+        if (ctrl & 0x80) {
+            o += n;
+            continue;
+        }
+
+        if ((i + n) > size) return false;
+        for (; n; n--) out[o++] ^= data[i++];
+    }
+
+    return true;
+}
+
+uint32_t rpc::_transport_capabilities()
+{
+    uint32_t capabilities = _CAPABILITIES;
+    if (!(_transport & RPC_TRANSPORT_RELIABLE)) capabilities &= ~RPC_CAPABILITY_ACKLESS;
+    if (!(_transport & RPC_TRANSPORT_INTEGRITY)) capabilities &= ~RPC_CAPABILITY_NO_CRC;
+    return capabilities;
+}
+
+size_t rpc::_fragment_size(size_t size)
+{
+    // Fragments fill whole frames of the smaller MTU, are at least 32 bytes so the 4 byte
+    // overhead stays small and are large enough that there are never more than 32.
+    size_t mtu = (!_mtu) ? _peer_mtu : ((!_peer_mtu) ? _mtu : min(_mtu, _peer_mtu));
+    size_t unit = mtu ? mtu : 16;
+    size_t frame = max(((size + 31) / 32) + 4, 32);
+    return (((frame + unit - 1) / unit) * unit) - 4;
+}
+
+// The payload sits at _buff + 2 like in a data packet. Each fragment is sent in place by
+// temporarily writing its index over the 2 bytes before its payload and its CRC over the
+// 2 bytes after it so the transport gets a single contiguous write.
+void rpc::__put_fragment_list(size_t size, uint32_t list)
+{
+    size_t fragment_size = _fragment_size(size);
+
+    for (size_t i = 0, offset = 0; offset < size; i++, offset += fragment_size) {
+        if (!(list & (1UL << i))) continue;
+        size_t len = min(fragment_size, size - offset);
+        uint8_t *fragment = _buff + offset;
+        uint8_t saved[4] = {fragment[0], fragment[1], fragment[len + 2], fragment[len + 3]};
+        fragment[0] = i;
+        fragment[1] = i >> 8;
+        uint16_t crc = __crc_16(fragment, len + 2);
+        fragment[len + 2] = crc;
+        fragment[len + 3] = crc >> 8;
+        put_bytes(fragment, len + 4, _put_long_timeout);
+        fragment[0] = saved[0];
+        fragment[1] = saved[1];
+        fragment[len + 2] = saved[2];
+        fragment[len + 3] = saved[3];
+    }
+}
+
+bool rpc::_put_fragments(size_t size, unsigned long timeout)
+{
+    size_t count = (size + _fragment_size(size) - 1) / _fragment_size(size);
+    uint32_t all = (count >= 32) ? 0xFFFFFFFF : ((1UL << count) - 1);
+    uint32_t missing = all;
+    uint8_t in_status[8];
+    unsigned long start = millis();
+
+    while ((millis() - start) < timeout) {
+        __put_fragment_list(size, missing);
+        _zero(in_status, sizeof(in_status));
+
+        // A lost status resends the last list which the receiver sorts out by index.
+        if (_get_packet(_FRAGMENT_PACKET_MAGIC, in_status, sizeof(in_status), _get_long_timeout)) {
+            missing = unpack_unsigned_long(in_status + 2) & all;
+            if (!missing) return true;
+        }
+    }
+
+    return false;
+}
+
+bool rpc::_get_fragments(size_t size, unsigned long timeout)
+{
+    size_t fragment_size = _fragment_size(size);
+    size_t count = (size + fragment_size - 1) / fragment_size;
+    uint32_t missing = (count >= 32) ? 0xFFFFFFFF : ((1UL << count) - 1);
+    uint8_t out_status[8];
+    unsigned long start = millis();
+
+    while ((millis() - start) < timeout) {
+        // The sender sends the missing fragments in order so their place is known up front.
+        for (size_t i = 0, offset = 0; offset < size; i++, offset += fragment_size) {
+            if (!(missing & (1UL << i))) continue;
+            size_t len = min(fragment_size, size - offset);
+            uint8_t *fragment = _buff + offset;
+            uint8_t saved[4] = {fragment[0], fragment[1], fragment[len + 2], fragment[len + 3]};
+
+            if (get_bytes(fragment, len + 4, _get_long_timeout)
+            && (((size_t) (fragment[0] | (fragment[1] << 8))) == i)
+            && ((fragment[len + 2] | (fragment[len + 3] << 8)) == __crc_16(fragment, len + 2))) {
+                missing &= ~(1UL << i);
+            }
+
+            fragment[0] = saved[0];
+            fragment[1] = saved[1];
+            fragment[len + 2] = saved[2];
+            fragment[len + 3] = saved[3];
+        }
+
+        _flush();
+        _set_packet(out_status, _FRAGMENT_PACKET_MAGIC, (uint8_t *) &missing, sizeof(missing));
+        put_bytes(out_status, sizeof(out_status), _put_short_timeout);
+        if (!missing) return true;
+    }
+
+    return false;
+}
+
+void rpc::stream_reader(rpc_stream_reader_callback_t callback, unsigned long queue_depth, unsigned long read_timeout,
+                        unsigned long buffers)
 {
     uint8_t packet[8];
-    _set_packet(packet, 0xEDF6, (uint8_t *) &queue_depth, sizeof(queue_depth));
+    bool resumable = __stream_resumable || __stream_latest_only;
+    const uint32_t setup[1] = {__stream_latest_only ? 0x80000001 : (resumable ? min(queue_depth, 0x7FFF) : queue_depth)};
+    _set_packet(packet, resumable ? _STREAM_RESUME_SETUP_MAGIC : 0xEDF6, (uint8_t *) setup, sizeof(setup));
     if (!_stream_put_bytes(packet, sizeof(packet), 1000)) return;
     uint8_t tx_lfsr = 255;
+    buffers = max(min(buffers, _buff_len), 1);
+    size_t slice_len = _buff_len / buffers;
+    __stream_window = queue_depth;
+    __stream_dropped = 0;
+    __stream_begin();
+    if (resumable) {
+        __stream_active = true;
+        __stream_call_callback = NULL;
+        __stream_reader_resumable(callback, __stream_latest_only ? 1 : queue_depth, read_timeout, buffers, slice_len);
+        __stream_active = false;
+        return;
+    }
 
-    for (;;) {
+    for (unsigned long slice = 0;; slice = (slice + 1) % buffers) {
         if (!_stream_get_bytes(packet, sizeof(packet), 1000)) return;
-        uint16_t magic = packet[0] | (packet[1] << 8);
-        uint16_t crc = packet[6] | (packet[7] << 8);
-        if ((magic != 0x542E) && (crc != __crc_16(packet, sizeof(packet) - 2))) return;
+        if (!_check_packet(0x542E, packet, sizeof(packet))) return;
         unsigned long size = unpack_unsigned_long(packet + 2);
-        if (_buff_len < size) return;
-        if (!_stream_get_bytes(_buff, size, read_timeout)) return;
-        if (callback) callback(_buff, size);
-        if (!_stream_put_bytes(&tx_lfsr, sizeof(tx_lfsr), 1000)) return;
-        tx_lfsr = (tx_lfsr >> 1) ^ ((tx_lfsr & 1) ? 0xB8 : 0x00);
+        uint8_t *frame = _buff + (slice * slice_len);
+        bool chunked = slice_len < size;
+        uint16_t crc = 0xFFFF;
+
+        if (chunked) {
+            if ((!__stream_chunk_callback) || (!__stream_get_chunks(frame, slice_len, size, read_timeout, &crc))) return;
+        } else if (!_stream_get_bytes(frame, size, read_timeout)) {
+            return;
+        }
+
+        // The next frame goes to another slice so the writer may send it while this one is processed.
+        if (buffers > 1) {
+            if (!_stream_put_bytes(&tx_lfsr, sizeof(tx_lfsr), 1000)) return;
+            tx_lfsr = (tx_lfsr >> 1) ^ ((tx_lfsr & 1) ? 0xB8 : 0x00);
+        }
+
+        __stream_count(sizeof(packet) + size);
+        if (callback && (!chunked)) callback(frame, size);
+
+        if (buffers <= 1) {
+            if (!_stream_put_bytes(&tx_lfsr, sizeof(tx_lfsr), 1000)) return;
+            tx_lfsr = (tx_lfsr >> 1) ^ ((tx_lfsr & 1) ? 0xB8 : 0x00);
+        }
     }
 }
 
-void rpc::stream_writer(rpc_stream_writer_callback_t callback, unsigned long write_timeout)
+// Slides over the byte stream one byte at a time until a valid packet lines up. Garbage is never
+// longer than a lost frame so the scan gives up after a buffer's worth of bytes.
+bool rpc::__stream_sync(uint16_t magic_value, uint8_t *packet, size_t size, unsigned long timeout, size_t have,
+                        uint16_t alt_magic_value)
+{
+    if ((have < size) && (!_stream_get_bytes(packet + have, size - have, timeout))) return false;
+
+    for (size_t i = 0; !(_check_packet(magic_value, packet, size) ||
+                         (alt_magic_value && _check_packet(alt_magic_value, packet, size))); i++) {
+        if (i >= _buff_len) return false;
+        memmove(packet, packet + 1, size - 1);
+        if (!_stream_get_bytes(packet + size - 1, 1, timeout)) return false;
+    }
+
+    return true;
+}
+
+bool rpc::__stream_get_chunks(uint8_t *buff, size_t buff_len, uint32_t size, unsigned long timeout, uint16_t *crc)
+{
+    for (uint32_t offset = 0; offset < size;) {
+        size_t len = min(size - offset, buff_len);
+        if (!_stream_get_bytes(buff, len, timeout)) return false;
+        *crc = __crc_16(buff, len, *crc);
+        __stream_chunk_callback(buff, len, offset, size);
+        offset += len;
+    }
+
+    return true;
+}
+
+bool rpc::__stream_put_ack(uint16_t sequence, bool resume)
+{
+    uint8_t packet[8];
+    const uint16_t ack[2] = {sequence, (uint16_t) ((resume ? 0x8000 : 0) | __stream_window)};
+    _set_packet(packet, _STREAM_RESUME_ACK_MAGIC, (uint8_t *) ack, sizeof(ack));
+    return _stream_put_bytes(packet, sizeof(packet), 1000);
+}
+
+// Packets are read whole once they start to arrive so that transports which frame at the MTU (e.g.
+// CAN) do not tear them. Transports that cannot tell are tried with a short read if guess is set.
+bool rpc::__stream_poll(uint8_t *packet, size_t size, bool guess)
+{
+    int available = _stream_available();
+    if (available > 0) return _stream_get_bytes(packet, size, 1000);
+    return (available < 0) && guess && _stream_get_bytes(packet, size, 1);
+}
+
+void rpc::_stream_call(uint32_t command, uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len)
+{
+    (void) command;
+    (void) data;
+    (void) size;
+    *out_data = NULL;
+    *out_data_len = 0;
+}
+
+bool rpc::_stream_put_call(uint32_t command, uint8_t *data, size_t size, rpc_stream_reader_callback_t callback)
 {
+    if (!__stream_active) return false;
     uint8_t packet[8];
-    if (!_stream_get_bytes(packet, sizeof(packet), 1000)) return;
-    uint16_t magic = packet[0] | (packet[1] << 8);
-    uint16_t crc = packet[6] | (packet[7] << 8);
-    if ((magic != 0xEDF6) && (crc != __crc_16(packet, sizeof(packet) - 2))) return;
-    unsigned long queue_depth = max(min(unpack_unsigned_long(packet + 2), _stream_writer_queue_depth_max), 1);
+    // The id tells a late result of an earlier call with the same command apart from ours.
+    __stream_call_id += 1;
+    uint8_t id[6] = {(uint8_t) command, (uint8_t) (command >> 8), (uint8_t) (command >> 16), (uint8_t) (command >> 24),
+                     (uint8_t) __stream_call_id, (uint8_t) (__stream_call_id >> 8)};
+    const uint32_t length[1] = {(uint32_t) (sizeof(id) + size)};
+    uint16_t crc = __crc_16(data, size, __crc_16(id, sizeof(id)));
+    uint8_t trailer[2] = {(uint8_t) crc, (uint8_t) (crc >> 8)};
+    const rpc_stream_fragment_t fragments[3] = {{id, sizeof(id)}, {data, (uint32_t) size}, {trailer, sizeof(trailer)}};
+    _set_packet(packet, _STREAM_CALL_MAGIC, (uint8_t *) length, sizeof(length));
+    __stream_call_command = command;
+    __stream_call_callback = callback;
+    return _stream_put_gather(packet, sizeof(packet), fragments, 3, 1000);
+}
+
+// Results too big for buff are read out and dropped.
+void rpc::__stream_get_result(uint8_t *packet, uint8_t *buff, size_t buff_len, unsigned long timeout)
+{
+    uint32_t command = unpack_unsigned_long(packet + 2);
+    unsigned long size = unpack_unsigned_long(packet + 6);
+    uint16_t crc = packet[10] | (packet[11] << 8);
+    uint16_t id = packet[12] | (packet[13] << 8);
+
+    for (unsigned long i = 0; i < size; i += buff_len) {
+        if (!_stream_get_bytes(buff, min(size - i, buff_len), timeout)) return;
+    }
+
+    if ((size > buff_len) || ((!_skip_crc) && (crc != __crc_16(buff, size)))) return;
+
+    if (__stream_call_callback && (command == __stream_call_command) && (id == __stream_call_id)) {
+        rpc_stream_reader_callback_t callback = __stream_call_callback;
+        __stream_call_callback = NULL;
+        callback(buff, size);
+    }
+}
+
+// Calls too big for the room left in _buff are read out and dropped. The master may call again.
+bool rpc::__stream_answer_call(uint8_t *packet, unsigned long timeout)
+{
+    unsigned long size = unpack_unsigned_long(packet + 2);
+    size_t room = _stream_writer_room();
+
+    if ((size < 6) || ((size + 2) > room)) {
+        for (unsigned long i = 0; i < (size + 2); i += room) {
+            if (!_stream_get_bytes(_buff, min(size + 2 - i, room), timeout)) return false;
+        }
+
+        return true;
+    }
+
+    if (!_stream_get_bytes(_buff, size + 2, timeout)) return false;
+    uint16_t crc = _buff[size] | (_buff[size + 1] << 8);
+    if ((!_skip_crc) && (crc != __crc_16(_buff, size))) return true;
+    uint32_t command = unpack_unsigned_long(_buff);
+    uint16_t id = _buff[4] | (_buff[5] << 8);
+    rpc_stream_fragment_t result = {NULL, 0};
+    size_t result_len = 0;
+    _stream_call(command, _buff + 6, size - 6, &result.data, &result_len);
+    result.len = result_len;
+    uint8_t header[16];
+    const uint16_t fields[6] = {(uint16_t) command, (uint16_t) (command >> 16), (uint16_t) result.len,
+                                (uint16_t) (result.len >> 16), __crc_16(result.data, result.len), id};
+    _set_packet(header, _STREAM_RESULT_MAGIC, (uint8_t *) fields, sizeof(fields));
+    return _stream_put_gather(header, sizeof(header), &result, 1, timeout);
+}
+
+void rpc::__stream_reader_resumable(rpc_stream_reader_callback_t callback, unsigned long queue_depth, unsigned long read_timeout,
+                                    unsigned long buffers, size_t slice_len)
+{
+    uint8_t packet[16];
+    uint16_t expected = 0, acked = 0;
+    bool resuming = false;
+    queue_depth = max(min(queue_depth, 0x7FFF), 1);
+    __stream_window = queue_depth;
+    unsigned long drain = 0, calm = 0, writer_window = 1;
+
+    for (unsigned long slice = 0, progress = millis(); (millis() - progress) <= read_timeout;) {
+        unsigned long wait = micros();
+        if (!__stream_sync(_STREAM_RESUME_FRAME_MAGIC, packet, sizeof(packet), 1000, 0, _STREAM_RESULT_MAGIC)) {
+            // Either a frame or our last ack got lost, so ask again.
+            if (!__stream_put_ack(expected, true)) return;
+            acked = expected;
+            resuming = true;
+            continue;
+        }
+
+        if (_check_packet(_STREAM_RESULT_MAGIC, packet, sizeof(packet))) {
+            // A result cut short shows up as a missing frame next.
+            __stream_get_result(packet, _buff + (slice * slice_len), slice_len, read_timeout);
+            continue;
+        }
+
+        unsigned long start = micros();
+        wait = start - wait;
+        uint16_t sequence = packet[2] | (packet[3] << 8);
+        uint16_t crc = packet[4] | (packet[5] << 8);
+        unsigned long size = unpack_unsigned_long(packet + 6);
+        bool batched = size & _BATCHED_LENGTH;
+        size &= ~_BATCHED_LENGTH;
+        writer_window = max(packet[10] | (packet[11] << 8), 1);
+        uint16_t dropped = packet[12] | (packet[13] << 8);
+        uint8_t *frame = _buff + (slice * slice_len);
+
+        bool chunked = (slice_len < size) && __stream_chunk_callback && (!batched);
+
+        // Frames we cannot use are still read out to stay in step with the byte stream.
+        if ((sequence != expected) || ((slice_len < size) && (!chunked))) {
+            for (unsigned long i = 0; i < size; i += slice_len) {
+                if (!_stream_get_bytes(frame, min(size - i, slice_len), read_timeout)) break;
+            }
+
+            if (sequence == expected) {
+                // Too big to ever be delivered so it is skipped.
+                expected += 1;
+                if (!__stream_put_ack(expected, false)) return;
+                acked = expected;
+            } else if (!resuming) {
+                if (!__stream_put_ack(expected, true)) return;
+                acked = expected;
+                resuming = true;
+            }
+
+            continue;
+        }
+
+        uint16_t frame_crc = 0xFFFF;
+        bool received = chunked ? __stream_get_chunks(frame, slice_len, size, read_timeout, &frame_crc)
+                                : _stream_get_bytes(frame, size, read_timeout);
+        if (received && (!chunked) && (!_skip_crc)) frame_crc = __crc_16(frame, size);
+
+        if ((!received) || ((!_skip_crc) && (crc != frame_crc))) {
+            if (!__stream_put_ack(expected, true)) return;
+            acked = expected;
+            resuming = true;
+            continue;
+        }
+
+        expected += 1;
+        resuming = false;
+        progress = millis();
+        __stream_dropped += dropped;
+        __stream_count(sizeof(packet) + size);
+        bool ack = ((uint16_t) (expected - acked)) >= (writer_window - (writer_window / 2));
+
+        if ((buffers > 1) && ack) {
+            if (!__stream_put_ack(expected, false)) return;
+            acked = expected;
+            ack = false;
+        }
+
+        if (callback && (!batched) && (!chunked)) callback(frame, size);
+
+        for (size_t i = 0; batched && ((i + 2) <= size);) {
+            size_t len = frame[i] | (frame[i + 1] << 8);
+            if ((size - i - 2) < len) break;
+            if (callback) callback(frame + i + 2, len);
+            i += 2 + len;
+        }
+
+        // The first frame also waits for the writer to start so it is not counted.
+        if (expected > 1) {
+            drain = max(((drain * 7) + (micros() - start)) / 8, 1);
+
+            if (wait > (drain / 4)) {
+                __stream_window = min(__stream_window + ((wait + drain - 1) / drain), queue_depth);
+                calm = 0;
+            } else if (++calm >= 4) {
+                __stream_window = max(__stream_window - 1, 1);
+                calm = 0;
+            }
+        } else {
+            drain = micros() - start;
+        }
+
+        if (ack) {
+            if (!__stream_put_ack(expected, false)) return;
+            acked = expected;
+        }
+
+        slice = (slice + 1) % buffers;
+    }
+}
+
+void rpc::stream_writer(rpc_stream_writer_callback_t callback, unsigned long write_timeout)
+{
+    __stream_writer(callback, NULL, write_timeout);
+}
+
+void rpc::stream_writer_gather(rpc_stream_gather_callback_t callback, unsigned long write_timeout)
+{
+    if (callback) __stream_writer(NULL, callback, write_timeout);
+}
+
+void rpc::__stream_writer(rpc_stream_writer_callback_t callback, rpc_stream_gather_callback_t gather_callback,
+                          unsigned long write_timeout)
+{
+    uint8_t packet[16];
+    if (!_stream_get_bytes(packet, 8, 1000)) return;
+    bool resumable = _check_packet(_STREAM_RESUME_SETUP_MAGIC, packet, 8);
+    if ((!resumable) && (!_check_packet(0xEDF6, packet, 8))) return;
+    unsigned long queue_depth = unpack_unsigned_long(packet + 2);
+    bool latest_only = resumable && (queue_depth & 0x80000000);
+    size_t batch_max = (resumable && (!latest_only)) ? min(__stream_batch_len, _stream_writer_room()) : 0;
+    if (resumable) queue_depth &= 0x7FFF;
+    queue_depth = max(min(queue_depth, _stream_writer_queue_depth_max), 1);
     uint8_t rx_lfsr = 255;
     unsigned long credits = queue_depth;
+    __stream_window = queue_depth;
+    __stream_begin();
+    uint16_t sequence = 0, acked = 0, dropped = 0;
+    rpc_stream_fragment_t frame, *fragments = &frame;
+    size_t fragments_len = 1;
+    bool pending = false;
 
-    for (;;) {
-        if (credits <= (queue_depth / 2)) {
+    for (unsigned long progress = millis();;) {
+        bool wait = credits <= (__stream_window / 2);
+
+        if ((!resumable) && wait) {
             if ((!_stream_get_bytes(packet, 1, 1000)) || (packet[0] != rx_lfsr)) return;
             rx_lfsr = (rx_lfsr >> 1) ^ ((rx_lfsr & 1) ? 0xB8 : 0x00);
             credits += 1;
+        } else if (resumable) {
+            // With credits to spare the writer only reads a call (or an early ack) that is already
+            // waiting so calls are answered ahead of the next frame. Transports that cannot tell only
+            // see calls while waiting for an ack. Latest only writers check for an ack without blocking.
+            bool polled = (!wait) || (latest_only && (!credits));
+            bool arrived = (!polled) || __stream_poll(packet, 8, wait);
+
+            if (!arrived) {
+                if (wait) {
+                    if ((millis() - progress) > write_timeout) return;
+                    if (!__stream_writer_fetch(callback, gather_callback, &frame, &fragments, &fragments_len)) return;
+                    if (pending && (dropped < 0xFFFF)) dropped += 1;
+                    pending = true;
+                }
+            } else if (!__stream_sync(_STREAM_RESUME_ACK_MAGIC, packet, 8, 1000, polled ? 8 : 0, _STREAM_CALL_MAGIC)) {
+                if ((millis() - progress) > write_timeout) return;
+            } else if (_check_packet(_STREAM_CALL_MAGIC, packet, 8)) {
+                if (!__stream_answer_call(packet, write_timeout)) return;
+            } else {
+                uint16_t next = packet[2] | (packet[3] << 8);
+                uint16_t window = packet[4] | (packet[5] << 8);
+                bool resume = window & 0x8000;
+                // Frames sent past the one the reader resumes from are lost so they count as dropped.
+                if (resume && (((int16_t) (sequence - next)) > 0)) {
+                    dropped = min(dropped + ((uint16_t) (sequence - next)), 0xFFFF);
+                }
+
+                // A resume rewinds to the reader, a plain ack may only move forward.
+                if (resume || (((int16_t) (next - acked)) > 0)) acked = next;
+                if (resume || (((int16_t) (sequence - acked)) < 0)) sequence = acked;
+                __stream_window = max(min(window & 0x7FFF, queue_depth), 1);
+                uint16_t in_flight = sequence - acked;
+                credits = (in_flight < __stream_window) ? (__stream_window - in_flight) : 0;
+                progress = millis();
+            }
+        }
+
+        if (credits > 0) {
+            if ((!pending) && (!__stream_writer_fetch(callback, gather_callback, &frame, &fragments, &fragments_len))) return;
+            pending = false;
+            rpc_stream_fragment_t batch, *out = fragments;
+            size_t out_len = fragments_len;
+            bool batched = false;
+
+            // Frames are copied into _buff until the next one does not fit or the delay is up. That
+            // one is held back for the next batch. A batch of one goes out as a plain frame.
+            if (batch_max) {
+                size_t batch_len = 0, count = 0;
+
+                for (unsigned long start = millis();;) {
+                    size_t len = 0;
+                    for (size_t i = 0; i < fragments_len; i++) len += fragments[i].len;
+
+                    if ((batch_len + 2 + len) > batch_max) {
+                        pending = count > 0;
+                        break;
+                    }
+
+                    _buff[batch_len] = len;
+                    _buff[batch_len + 1] = len >> 8;
+                    batch_len += 2;
+
+                    for (size_t i = 0; i < fragments_len; i++) {
+                        memmove(_buff + batch_len, fragments[i].data, fragments[i].len);
+                        batch_len += fragments[i].len;
+                    }
+
+                    count += 1;
+                    if (__stream_batch_delay && ((millis() - start) >= __stream_batch_delay)) break;
+                    if (!__stream_writer_fetch(callback, gather_callback, &frame, &fragments, &fragments_len)) return;
+                }
+
+                if ((count > 1) || pending) {
+                    batched = count > 1;
+                    batch.data = _buff + (batched ? 0 : 2);
+                    batch.len = batch_len - (batched ? 0 : 2);
+                    out = &batch;
+                    out_len = 1;
+                }
+            }
+
+            uint32_t out_data_len = 0;
+            uint16_t crc = 0xFFFF;
+
+            for (size_t i = 0; i < out_len; i++) {
+                out_data_len += out[i].len;
+                if (resumable) crc = __crc_16(out[i].data, out[i].len, crc);
+            }
+
+            size_t packet_len = 8;
+
+            if (resumable) {
+                if (batched) out_data_len |= _BATCHED_LENGTH;
+                const uint16_t header[6] = {sequence, crc, (uint16_t) out_data_len, (uint16_t) (out_data_len >> 16),
+                                            (uint16_t) __stream_window, dropped};
+                _set_packet(packet, _STREAM_RESUME_FRAME_MAGIC, (uint8_t *) header, sizeof(header));
+                packet_len = 16;
+                sequence += 1;
+                dropped = 0;
+            } else {
+                _set_packet(packet, 0x542E, (uint8_t *) &out_data_len, sizeof(out_data_len));
+            }
+
+            __stream_pace(packet_len + (out_data_len & ~_BATCHED_LENGTH));
+            if (!_stream_put_gather(packet, packet_len, out, out_len, write_timeout)) return;
+            __stream_count(packet_len + (out_data_len & ~_BATCHED_LENGTH));
+            credits -= 1;
         }
+    }
+}
+
+bool rpc::__stream_writer_fetch(rpc_stream_writer_callback_t callback, rpc_stream_gather_callback_t gather_callback,
+                                rpc_stream_fragment_t *frame, rpc_stream_fragment_t **fragments, size_t *fragments_len)
+{
+    if (!gather_callback) {
+        *fragments = frame;
+        *fragments_len = 1;
+        return _stream_writer_frame(callback, &frame->data, &frame->len);
+    }
+
+    *fragments = NULL;
+    *fragments_len = 0;
+    gather_callback(fragments, fragments_len);
+    return (*fragments) || (!(*fragments_len));
+}
+
+// Channel frames carry the channel in the top 8 bits of the length so they are limited to 16MB.
+void rpc::stream_reader_channels(rpc_stream_channel_t *channels, size_t channels_len, unsigned long read_timeout)
+{
+    uint8_t packet[8];
+    if ((!channels_len) || (channels_len > 256)) return;
+
+    for (size_t i = 0; i < channels_len; i++) {
+        const uint32_t setup[1] = {(((uint32_t) i) << 24) | (channels[i].queue_depth & 0xFFFFFF)};
+        _set_packet(packet, _STREAM_CHANNEL_SETUP_MAGIC, (uint8_t *) setup, sizeof(setup));
+        if (!_stream_put_bytes(packet, sizeof(packet), 1000)) return;
+        channels[i].lfsr = 255;
+    }
+
+    __stream_begin();
+
+    for (;;) {
+        if (!_stream_get_bytes(packet, sizeof(packet), 1000)) return;
+        if (!_check_packet(_STREAM_CHANNEL_FRAME_MAGIC, packet, sizeof(packet))) return;
+        unsigned long header = unpack_unsigned_long(packet + 2);
+        size_t channel = header >> 24;
+        unsigned long size = header & 0xFFFFFF;
+        if ((channel >= channels_len) || (_buff_len < size)) return;
+        if (!_stream_get_bytes(_buff, size, read_timeout)) return;
+        __stream_count(sizeof(packet) + size);
+        if (channels[channel].reader) channels[channel].reader(_buff, size);
+        uint8_t credit[2] = {(uint8_t) channel, channels[channel].lfsr};
+        if (!_stream_put_bytes(credit, sizeof(credit), 1000)) return;
+        channels[channel].lfsr = (channels[channel].lfsr >> 1) ^ ((channels[channel].lfsr & 1) ? 0xB8 : 0x00);
+    }
+}
+
+void rpc::stream_writer_channels(rpc_stream_channel_t *channels, size_t channels_len, unsigned long write_timeout)
+{
+    uint8_t packet[8];
+    if ((!channels_len) || (channels_len > 256)) return;
+
+    for (size_t i = 0; i < channels_len; i++) {
+        if (!_stream_get_bytes(packet, sizeof(packet), 1000)) return;
+        if (!_check_packet(_STREAM_CHANNEL_SETUP_MAGIC, packet, sizeof(packet))) return;
+        unsigned long setup = unpack_unsigned_long(packet + 2);
+        size_t channel = setup >> 24;
+        if (channel >= channels_len) return;
+        channels[channel].queue_depth = max(min(setup & 0xFFFFFF, _stream_writer_queue_depth_max), 1);
+        channels[channel].credits = channels[channel].queue_depth;
+        channels[channel].lfsr = 255;
+    }
+
+    __stream_begin();
+
+    // Channels take turns so a busy channel cannot starve the others.
+    for (size_t next = 0;;) {
+        bool ready = false;
+
+        for (size_t i = 0; (i < channels_len) && (!ready); i++) {
+            ready = channels[i].writer && (channels[i].credits > (channels[i].queue_depth / 2));
+        }
+
+        if (!ready) {
+            uint8_t credit[2];
+            if (!_stream_get_bytes(credit, sizeof(credit), 1000)) return;
+            if ((credit[0] >= channels_len) || (credit[1] != channels[credit[0]].lfsr)) return;
+            rpc_stream_channel_t *channel = channels + credit[0];
+            channel->lfsr = (channel->lfsr >> 1) ^ ((channel->lfsr & 1) ? 0xB8 : 0x00);
+            channel->credits = min(channel->credits + 1, channel->queue_depth);
+        }
+
+        for (size_t i = 0; i < channels_len; i++, next = (next + 1) % channels_len) {
+            if ((!channels[next].writer) || (!channels[next].credits)) continue;
+            uint8_t *out_data;
+            uint32_t out_data_len;
+            if (!_stream_writer_frame(channels[next].writer, &out_data, &out_data_len)) return;
+            if (out_data_len > 0xFFFFFF) return;
+            const uint32_t header[1] = {(((uint32_t) next) << 24) | out_data_len};
+            const rpc_stream_fragment_t fragment = {out_data, out_data_len};
+            _set_packet(packet, _STREAM_CHANNEL_FRAME_MAGIC, (uint8_t *) header, sizeof(header));
+            __stream_pace(sizeof(packet) + out_data_len);
+            if (!_stream_put_gather(packet, sizeof(packet), &fragment, 1, write_timeout)) return;
+            __stream_count(sizeof(packet) + out_data_len);
+            channels[next].credits -= 1;
+            next = (next + 1) % channels_len;
+            break;
+        }
+    }
+}
+
+void rpc::stream_duplex(rpc_stream_channel_t *channels, size_t channels_len, unsigned long timeout)
+{
+    uint8_t packet[8];
+    if ((!channels_len) || (channels_len > 256)) return;
+
+    for (size_t i = 0; i < channels_len; i++) {
+        const uint32_t setup[1] = {(((uint32_t) i) << 24) | (channels[i].reader ? (channels[i].queue_depth & 0xFFFFFF) : 0)};
+        _set_packet(packet, _STREAM_DUPLEX_SETUP_MAGIC, (uint8_t *) setup, sizeof(setup));
+        if (!_stream_put_bytes(packet, sizeof(packet), timeout)) return;
+    }
+
+    for (size_t i = 0; i < channels_len; i++) {
+        if (!_stream_get_bytes(packet, sizeof(packet), timeout)) return;
+        if (!_check_packet(_STREAM_DUPLEX_SETUP_MAGIC, packet, sizeof(packet))) return;
+        unsigned long setup = unpack_unsigned_long(packet + 2);
+        size_t channel = setup >> 24;
+        if (channel >= channels_len) return;
+        channels[channel].credits = min(setup & 0xFFFFFF, _stream_writer_queue_depth_max);
+    }
+
+    __stream_begin();
+
+    for (size_t next = 0;;) {
+        bool sent = false;
+
+        // One frame per turn so the other direction's frames and credits are read in between.
+        for (size_t i = 0; (i < channels_len) && (!sent); i++, next = (next + 1) % channels_len) {
+            if ((!channels[next].writer) || (!channels[next].credits)) continue;
+            uint8_t *out_data;
+            uint32_t out_data_len;
+            if (!_stream_writer_frame(channels[next].writer, &out_data, &out_data_len)) return;
+            if (out_data_len > 0xFFFFFF) return;
+            const uint32_t header[1] = {(((uint32_t) next) << 24) | out_data_len};
+            const rpc_stream_fragment_t fragment = {out_data, out_data_len};
+            _set_packet(packet, _STREAM_DUPLEX_FRAME_MAGIC, (uint8_t *) header, sizeof(header));
+            __stream_pace(sizeof(packet) + out_data_len);
+            if (!_stream_put_gather(packet, sizeof(packet), &fragment, 1, timeout)) return;
+            __stream_count(sizeof(packet) + out_data_len);
+            channels[next].credits -= 1;
+            sent = true;
+        }
+
+        // Only wait for the peer when there is nothing left to send.
+        if (sent) {
+            if (!__stream_poll(packet, sizeof(packet), true)) continue;
+        } else if (!_stream_get_bytes(packet, sizeof(packet), timeout)) {
+            return;
+        }
+
+        unsigned long header = unpack_unsigned_long(packet + 2);
+        size_t channel = header >> 24;
+        if (channel >= channels_len) return;
+
+        if (_check_packet(_STREAM_DUPLEX_CREDIT_MAGIC, packet, sizeof(packet))) {
+            channels[channel].credits += header & 0xFFFFFF;
+            continue;
+        }
+
+        if (!_check_packet(_STREAM_DUPLEX_FRAME_MAGIC, packet, sizeof(packet))) return;
+        unsigned long size = header & 0xFFFFFF;
+        if (_buff_len < size) return;
+        if (!_stream_get_bytes(_buff, size, timeout)) return;
+        __stream_count(sizeof(packet) + size);
+        if (channels[channel].reader) channels[channel].reader(_buff, size);
+        const uint32_t credit[1] = {(((uint32_t) channel) << 24) | 1};
+        _set_packet(packet, _STREAM_DUPLEX_CREDIT_MAGIC, (uint8_t *) credit, sizeof(credit));
+        if (!_stream_put_bytes(packet, sizeof(packet), timeout)) return;
+    }
+}
+
+bool rpc::_stream_writer_frame(rpc_stream_writer_callback_t callback, uint8_t **data, uint32_t *size)
+{
+    if (!callback) return false;
+    callback(data, size);
+    return true;
+}
+
+bool rpc::_stream_get_bytes(uint8_t *buff, size_t size, unsigned long timeout)
+{
+    return get_bytes(buff, size, timeout);
+}
+
+bool rpc::_stream_put_bytes(uint8_t *data, size_t size, unsigned long timeout)
+{
+    return put_bytes(data, size, timeout);
+}
+
+bool rpc::_stream_put_gather(uint8_t *header, size_t header_len,
+                             const rpc_stream_fragment_t *fragments, size_t fragments_len, unsigned long timeout)
+{
+    if (!_stream_put_bytes(header, header_len, 1000)) return false;
+
+    for (size_t i = 0; i < fragments_len; i++) {
+        if (fragments[i].len && (!_stream_put_bytes(fragments[i].data, fragments[i].len, timeout))) return false;
+    }
+
+    return true;
+}
+
+rpc_master::rpc_master(uint8_t *buff, size_t buff_len) : rpc(buff, buff_len)
+{
+    _set_packet(__out_result_header_ack, _RESULT_HEADER_PACKET_MAGIC, NULL, 0);
+    _set_packet(__out_result_data_ack, _RESULT_DATA_PACKET_MAGIC, NULL, 0);
+    _zero(__out_result_data_nak, sizeof(__out_result_data_nak));
+    _set_packet(__out_result_data_nak, _NAK_PACKET_MAGIC, __out_result_data_nak + 2, sizeof(__out_result_data_nak) - 4);
+}
+
+bool rpc_master::__chunked(size_t size)
+{
+    return (__capabilities & RPC_CAPABILITY_CHUNKED) && ((size + 4) > min(_buff_len, __peer_buff_len));
+}
+
+bool rpc_master::__fragmented(size_t size)
+{
+    return (__capabilities & RPC_CAPABILITY_FRAGMENTS) && (size > _fragment_size(size));
+}
+
+bool rpc_master::__put_command(uint32_t command, uint8_t *data, size_t size, unsigned long timeout)
+{
+    uint8_t out_header[12];
+    __batch_end(command);
+    bool chunked = __chunked(size);
+    if ((!chunked) && (_buff_len < (size + 4))) return false;
+    bool compressed = (!chunked) && (__capabilities & RPC_CAPABILITY_COMPRESSION)
+                   && _compress(&data, &size, _buff + 2, __peer_buff_len);
+    const uint32_t header[2] = {command, compressed ? (size | _COMPRESSED_LENGTH) : size};
+    _put_short_timeout = _put_short_timeout_reset;
+    _get_short_timeout = _get_short_timeout_reset;
+    _set_packet(out_header, _COMMAND_HEADER_PACKET_MAGIC, (uint8_t *) header, 8);
+    if (!chunked) _set_packet(_buff, _COMMAND_DATA_PACKET_MAGIC, data, size);
+    unsigned long start = millis();
+
+    while ((millis() - start) < timeout) {
+        _zero(__in_command_header_buf, sizeof(__in_command_header_buf));
+        _zero(__in_command_data_buf, sizeof(__in_command_data_buf));
+        _flush();
+        put_bytes(out_header, sizeof(out_header), _put_short_timeout);
+        if (_get_packet(_COMMAND_HEADER_PACKET_MAGIC, __in_command_header_buf, sizeof(__in_command_header_buf), _get_short_timeout)) {
+            if (chunked) return __put_command_chunks(data, size, timeout);
+            if (__fragmented(size)) return _put_fragments(size, timeout);
+
+            // A NAK only asks for the data packet again so the header is not resent.
+            for (bool resend = true; resend && ((millis() - start) < timeout);) {
+                _zero(__in_command_data_buf, sizeof(__in_command_data_buf));
+                put_bytes(_buff, size + 4, _put_long_timeout);
+                if (_get_packet(_COMMAND_DATA_PACKET_MAGIC, __in_command_data_buf, sizeof(__in_command_data_buf), _get_short_timeout)) {
+                    return true;
+                }
+                resend = (__capabilities & RPC_CAPABILITY_NAK)
+                      && _check_packet(_NAK_PACKET_MAGIC, __in_command_data_buf, sizeof(__in_command_data_buf));
+            }
+        }
+
+        // Avoid timeout livelocking.
+        _put_short_timeout = min((_put_short_timeout * 6) / 4, timeout);
+        _get_short_timeout = min((_get_short_timeout * 6) / 4, timeout);
+    }
+
+    return false;
+}
+
+bool rpc_master::__put_command_chunks(uint8_t *data, size_t size, unsigned long timeout)
+{
+    size_t chunk_size = _chunk_size(__peer_buff_len);
+    uint32_t offset = 0;
+    uint8_t in_ack[8];
+    _put_short_timeout = _put_short_timeout_reset;
+    _get_short_timeout = _get_short_timeout_reset;
+    unsigned long start = millis();
+
+    // The timeout applies per chunk so that large transfers are not cut short.
+    while ((offset < size) && ((millis() - start) < timeout)) {
+        size_t len = min(chunk_size, size - offset);
+        memcpy(_buff + 2, &offset, sizeof(offset));
+        memcpy(_buff + 6, data + offset, len);
+        _set_packet(_buff, _COMMAND_CHUNK_PACKET_MAGIC, _buff + 2, len + 4);
+        _zero(in_ack, sizeof(in_ack));
+        _flush();
+        put_bytes(_buff, len + 8, _put_long_timeout);
+
+        if (_get_packet(_COMMAND_CHUNK_PACKET_MAGIC, in_ack, sizeof(in_ack), _get_short_timeout)
+        && (unpack_unsigned_long(in_ack + 2) == offset)) {
+            offset += len;
+            _put_short_timeout = _put_short_timeout_reset;
+            _get_short_timeout = _get_short_timeout_reset;
+            start = millis();
+            continue;
+        }
+
+        // Avoid timeout livelocking.
+        _put_short_timeout = min((_put_short_timeout * 6) / 4, timeout);
+        _get_short_timeout = min((_get_short_timeout * 6) / 4, timeout);
+    }
+
+    return offset == size;
+}
+
+bool rpc_master::__get_result(uint8_t **data, size_t *size, unsigned long timeout, rpc_chunk_callback_t callback)
+{
+    _put_short_timeout = _put_short_timeout_reset;
+    _get_short_timeout = _get_short_timeout_reset;
+    unsigned long start = millis();
+
+    while ((millis() - start) < timeout) {
+        _zero(__in_result_header_buf, sizeof(__in_result_header_buf));
+        _flush();
+        put_bytes(__out_result_header_ack, sizeof(__out_result_header_ack), _put_short_timeout);
+        if (_get_packet(_RESULT_HEADER_PACKET_MAGIC, __in_result_header_buf, sizeof(__in_result_header_buf), _get_short_timeout)) {
+            uint32_t in_result_header = unpack_unsigned_long(__in_result_header_buf + 2);
+            uint32_t in_result_data_buf_len = (in_result_header & ~_COMPRESSED_LENGTH) + 4;
+            size_t in_result_data_len = in_result_data_buf_len - 4;
+
+            // The slave skips the data phase when the master's copy is still current.
+            __not_modified = in_result_header == _NOT_MODIFIED_LENGTH;
+            if (__not_modified) {
+                if (data) *data = _buff;
+                if (size) *size = 0;
+                return true;
+            }
+
+            if (__chunked(in_result_data_len)) return __get_result_chunks(in_result_data_len, callback, timeout);
+            if (_buff_len < in_result_data_buf_len) return false;
+            put_bytes(__out_result_data_ack, sizeof(__out_result_data_ack), _put_short_timeout);
+
+            if (__fragmented(in_result_data_len)) {
+                if (!_get_fragments(in_result_data_len, timeout)) return false;
+                if ((in_result_header & _COMPRESSED_LENGTH) && (!_decompress(_buff + 2, &in_result_data_len))) return false;
+                if (callback) callback(_buff + 2, in_result_data_len, 0, in_result_data_len);
+                if (data) *data = _buff + 2;
+                if (size) *size = in_result_data_len;
+                return true;
+            }
+
+            for (;;) {
+                if (_get_packet(_RESULT_DATA_PACKET_MAGIC, _buff, in_result_data_buf_len, _get_long_timeout)) {
+                    if ((in_result_header & _COMPRESSED_LENGTH) && (!_decompress(_buff + 2, &in_result_data_len))) return false;
+
+                    if (callback) {
+                        callback(_buff + 2, in_result_data_len, 0, in_result_data_len);
+                        return true;
+                    }
+
+                    *data = _buff + 2;
+                    *size = in_result_data_len;
+                    return true;
+                }
+
+                // The slave has already moved on so a NAK is the only way to get the data again.
+                if ((!(__capabilities & RPC_CAPABILITY_NAK)) || ((millis() - start) >= timeout)) break;
+                _flush();
+                put_bytes(__out_result_data_nak, sizeof(__out_result_data_nak), _put_short_timeout);
+            }
+        }
+
+        // Avoid timeout livelocking.
+        _put_short_timeout = min((_put_short_timeout * 6) / 4, timeout);
+        _get_short_timeout = min((_get_short_timeout * 6) / 4, timeout);
+    }
+
+    return false;
+}
+
+bool rpc_master::__get_result_chunks(uint32_t size, rpc_chunk_callback_t callback, unsigned long timeout)
+{
+    size_t chunk_size = _chunk_size(__peer_buff_len);
+    uint32_t offset = 0;
+    uint8_t out_request[8];
+    _put_short_timeout = _put_short_timeout_reset;
+    _get_short_timeout = _get_short_timeout_reset;
+    unsigned long start = millis();
+
+    // Without a callback there is nowhere to put the result so the transfer is cancelled.
+    while (callback && (offset < size) && ((millis() - start) < timeout)) {
+        size_t len = min(chunk_size, size - offset);
+        _set_packet(out_request, _RESULT_CHUNK_PACKET_MAGIC, (uint8_t *) &offset, sizeof(offset));
+        _flush();
+        put_bytes(out_request, sizeof(out_request), _put_short_timeout);
+
+        if (_get_packet(_RESULT_CHUNK_PACKET_MAGIC, _buff, len + 8, _get_long_timeout)
+        && (unpack_unsigned_long(_buff + 2) == offset)) {
+            callback(_buff + 6, len, offset, size);
+            offset += len;
+            _put_short_timeout = _put_short_timeout_reset;
+            _get_short_timeout = _get_short_timeout_reset;
+            start = millis();
+            continue;
+        }
+
+        // Avoid timeout livelocking.
+        _put_short_timeout = min((_put_short_timeout * 6) / 4, timeout);
+        _get_short_timeout = min((_get_short_timeout * 6) / 4, timeout);
+    }
+
+    // Asking for the offset past the end releases the slave.
+    _set_packet(out_request, _RESULT_CHUNK_PACKET_MAGIC, (uint8_t *) &size, sizeof(size));
+    put_bytes(out_request, sizeof(out_request), _put_short_timeout);
+    return callback && (offset == size);
+}
+
+size_t rpc_master::__set_fast_frame(uint32_t command, uint8_t *data, size_t size)
+{
+    bool compressed = (__capabilities & RPC_CAPABILITY_COMPRESSION) && _compress(&data, &size, _buff + 14, __peer_buff_len);
+    const uint32_t header[2] = {command, compressed ? (size | _COMPRESSED_LENGTH) : size};
+    _set_packet(_buff + 12, _COMMAND_DATA_PACKET_MAGIC, data, size);
+    _set_packet(_buff, _FAST_COMMAND_PACKET_MAGIC, (uint8_t *) header, 8);
+    return size + 16;
+}
+
+bool rpc_master::__fast_call(uint32_t command, uint8_t *data, size_t size, uint8_t **result, size_t *result_size,
+                             unsigned long send_timeout, unsigned long recv_timeout)
+{
+    // Batches are built in place so the frame cannot be rebuilt once a receive overwrites it.
+    bool in_buff = (data >= _buff) && (data < (_buff + _buff_len));
+    __batch_end(command);
+    if (_buff_len < (size + 16)) return false;
+
+    // Reliable links neither lose nor reorder bytes so one write and one read is enough.
+    if (__capabilities & RPC_CAPABILITY_ACKLESS) {
+        size_t frame_len = __set_fast_frame(command, data, size);
+        _flush(); // Drops a late result from a call that timed out.
+        if (!put_bytes(_buff, frame_len, send_timeout)) return false;
+        if (!_get_packet(_FAST_RESULT_PACKET_MAGIC, __in_result_header_buf, sizeof(__in_result_header_buf), recv_timeout)) return false;
+        uint32_t in_result_header = unpack_unsigned_long(__in_result_header_buf + 2);
+        uint32_t in_result_data_buf_len = (in_result_header & ~_COMPRESSED_LENGTH) + 4;
+        __not_modified = in_result_header == _NOT_MODIFIED_LENGTH;
+        *result = _buff;
+        *result_size = 0;
+        if (__not_modified) return true;
+        if ((_buff_len < in_result_data_buf_len) || (__peer_buff_len < (in_result_data_buf_len + 8))) return false;
+        if (!_get_packet(_RESULT_DATA_PACKET_MAGIC, _buff, in_result_data_buf_len, recv_timeout)) return false;
+        *result = _buff + 2;
+        *result_size = in_result_data_buf_len - 4;
+        return (!(in_result_header & _COMPRESSED_LENGTH)) || _decompress(*result, result_size);
+    }
+
+    _put_short_timeout = _put_short_timeout_reset;
+    _get_short_timeout = _get_short_timeout_reset;
+    unsigned long start = millis();
+
+    size_t frame_len = 0;
+
+    for (bool build = true; (millis() - start) < (send_timeout + recv_timeout);) {
+        // The frame is rebuilt after a receive overwrote _buff.
+        if (build) {
+            frame_len = __set_fast_frame(command, data, size);
+            build = false;
+        }
+
+        _zero(__in_result_header_buf, sizeof(__in_result_header_buf));
+        _flush();
+        put_bytes(_buff, frame_len, _put_long_timeout);
+        unsigned long poll_start = millis();
+
+        // Poll without resending so the slave only runs the callback once per frame.
+        while ((millis() - poll_start) < recv_timeout) {
+            if (!get_bytes(__in_result_header_buf, sizeof(__in_result_header_buf), _get_short_timeout)) continue;
+
+            if (_check_packet(_FAST_RESULT_PACKET_MAGIC, __in_result_header_buf, sizeof(__in_result_header_buf))) {
+                uint32_t in_result_header = unpack_unsigned_long(__in_result_header_buf + 2);
+                uint32_t in_result_data_buf_len = (in_result_header & ~_COMPRESSED_LENGTH) + 4;
+                __not_modified = in_result_header == _NOT_MODIFIED_LENGTH;
+
+                if (__not_modified) {
+                    *result = _buff;
+                    *result_size = 0;
+                    return true;
+                }
+
+                // The slave sends just the header for results too big for its fast frames.
+                if ((_buff_len < in_result_data_buf_len) || (__peer_buff_len < (in_result_data_buf_len + 8))) return false;
+                build = true;
+                if (_get_packet(_RESULT_DATA_PACKET_MAGIC, _buff, in_result_data_buf_len, _get_long_timeout)) {
+                    *result = _buff + 2;
+                    *result_size = in_result_data_buf_len - 4;
+                    return (!(in_result_header & _COMPRESSED_LENGTH)) || _decompress(*result, result_size);
+                }
+                if (!(__capabilities & RPC_CAPABILITY_NAK)) break;
+                // Ask for the result frame again instead of running the command twice.
+                _flush();
+                put_bytes(__out_result_data_nak, sizeof(__out_result_data_nak), _put_short_timeout);
+            } else if ((__capabilities & RPC_CAPABILITY_NAK)
+                   && _check_packet(_NAK_PACKET_MAGIC, __in_result_header_buf, sizeof(__in_result_header_buf))) {
+                break; // The slave lost the command frame so resend it right away.
+            }
+        }
+
+        // Batches are built in place and are gone once a receive overwrote them.
+        if (build && in_buff) return false;
+
+        // Avoid timeout livelocking.
+        _put_short_timeout = min((_put_short_timeout * 6) / 4, send_timeout);
+        _get_short_timeout = min((_get_short_timeout * 6) / 4, recv_timeout);
+    }
+
+    return false;
+}
+
+bool rpc_master::__call(uint32_t command, uint8_t *data, size_t size, uint8_t **result, size_t *result_size,
+                        unsigned long send_timeout, unsigned long recv_timeout)
+{
+    rpc_cache_entry_t *entry = NULL;
+
+    for (size_t i = 0; (i < __cache_dict_alloced) && (!entry); i++) {
+        if (__cache_dict[i].key == command) entry = __cache_dict + i;
+    }
+
+    // Cached results are only reused for the same args and until they are ttl ms old.
+    if (entry) {
+        if (entry->valid && ((millis() - entry->stamp) < entry->ttl)
+        && (entry->args_len == size) && ((!size) || (!memcmp(entry->data, data, size)))) {
+            __cache_hits += 1;
+            *result = entry->data + size;
+            *result_size = entry->data_len - size;
+            return true;
+        }
+
+        __cache_misses += 1;
+        entry->valid = false;
+    }
+
+    bool ok;
+
+    // Payloads too big for a single fast frame on either side go through the legacy exchange (chunked if need be).
+    if ((__capabilities & (RPC_CAPABILITY_FAST_CALL | RPC_CAPABILITY_ACKLESS)) && (!__chunked(size))
+    && (min(_buff_len, __peer_buff_len) >= (size + 16))) {
+        ok = __fast_call(command, data, size, result, result_size, send_timeout, recv_timeout);
+    } else {
+        ok = __put_command(command, data, size, send_timeout)
+          && __get_result(result, result_size, recv_timeout);
+    }
+
+    if (ok && entry && ((size + *result_size) <= entry->data_max)) {
+        if (size) memcpy(entry->data, data, size);
+        if (*result_size) memcpy(entry->data + size, *result, *result_size);
+        entry->args_len = size;
+        entry->data_len = size + *result_size;
+        entry->stamp = millis();
+        entry->valid = true;
+    }
+
+    return ok;
+}
+
+void rpc_master::set_cache_dict(rpc_cache_entry_t *cache_dict, size_t cache_dict_len)
+{
+    __cache_dict = cache_dict;
+    __cache_dict_len = cache_dict_len;
+    __cache_dict_alloced = 0;
+}
+
+bool rpc_master::__register_cache(uint32_t command, void *buff, size_t buff_len, unsigned long ttl)
+{
+    rpc_cache_entry_t *entry = NULL;
+
+    for (size_t i = 0; (i < __cache_dict_alloced) && (!entry); i++) {
+        if (__cache_dict[i].key == command) entry = __cache_dict + i;
+    }
+
+    if ((!entry) && (__cache_dict_alloced < __cache_dict_len)) entry = __cache_dict + __cache_dict_alloced++;
+    if (!entry) return false;
+    entry->key = command;
+    entry->data = (uint8_t *) buff;
+    entry->data_max = buff_len;
+    entry->data_len = 0;
+    entry->args_len = 0;
+    entry->ttl = ttl;
+    entry->stamp = 0;
+    entry->valid = false;
+    return true;
+}
+
+bool rpc_master::register_cache(const __FlashStringHelper *name, void *buff, size_t buff_len, unsigned long ttl)
+{
+    return __register_cache(_hash(name), buff, buff_len, ttl);
+}
+
+bool rpc_master::register_cache(const String &name, void *buff, size_t buff_len, unsigned long ttl)
+{
+    return __register_cache(_hash(name.c_str(), name.length()), buff, buff_len, ttl);
+}
+
+bool rpc_master::register_cache(const char *name, void *buff, size_t buff_len, unsigned long ttl)
+{
+    return __register_cache(_hash(name), buff, buff_len, ttl);
+}
+
+void rpc_master::invalidate_cache()
+{
+    for (size_t i = 0; i < __cache_dict_alloced; i++) __cache_dict[i].valid = false;
+}
+
+bool rpc_master::__put_pipelined_command(uint32_t command, uint8_t *data, size_t size, uint16_t *seq, unsigned long timeout)
+{
+    // The sequence number shares the length word so pipelined payloads are limited to 64KB.
+    const uint32_t header[2] = {command, size | (((uint32_t) __pipeline_seq) << 16)};
+    __batch_end(command);
+    if (!(__capabilities & RPC_CAPABILITY_PIPELINE)) return false;
+    if (__pipeline_outstanding >= get_pipeline_depth()) return false;
+    if ((_buff_len < (size + 16)) || (size > 0xFFFF)) return false;
+    _set_packet(_buff + 12, _COMMAND_DATA_PACKET_MAGIC, data, size);
+    _set_packet(_buff, _PIPELINED_COMMAND_PACKET_MAGIC, (uint8_t *) header, 8);
+    if (!put_bytes(_buff, size + 16, timeout)) return false;
+    if (seq) *seq = __pipeline_seq;
+    __pipeline_seq += 1;
+    __pipeline_outstanding += 1;
+    return true;
+}
+
+bool rpc_master::call_pipelined(const __FlashStringHelper *name,
+                                void *command_data, size_t command_data_len, uint16_t *seq,
+                                unsigned long send_timeout)
+{
+    return __put_pipelined_command(_hash(name), (uint8_t *) command_data, command_data_len, seq, send_timeout);
+}
+
+bool rpc_master::call_pipelined(const String &name,
+                                void *command_data, size_t command_data_len, uint16_t *seq,
+                                unsigned long send_timeout)
+{
+    return __put_pipelined_command(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len, seq, send_timeout);
+}
+
+bool rpc_master::call_pipelined(const char *name,
+                                void *command_data, size_t command_data_len, uint16_t *seq,
+                                unsigned long send_timeout)
+{
+    return __put_pipelined_command(_hash(name), (uint8_t *) command_data, command_data_len, seq, send_timeout);
+}
+
+bool rpc_master::get_pipelined_result(uint16_t *seq, void **result_data, size_t *result_data_len,
+                                      unsigned long recv_timeout)
+{
+    if (!__pipeline_outstanding) return false;
+    _get_short_timeout = _get_short_timeout_reset;
+    unsigned long start = millis();
+
+    // Results come back in order but the slave tags each one so the caller can match them.
+    while ((millis() - start) < recv_timeout) {
+        _zero(__in_result_header_buf, sizeof(__in_result_header_buf));
+        if (_get_packet(_PIPELINED_RESULT_PACKET_MAGIC, __in_result_header_buf, sizeof(__in_result_header_buf), _get_short_timeout)) {
+            uint32_t in_result_header = unpack_unsigned_long(__in_result_header_buf + 2);
+            uint32_t in_result_data_buf_len = (in_result_header & 0xFFFF) + 4;
+            __pipeline_outstanding -= 1;
+            if (seq) *seq = in_result_header >> 16;
+            if ((_buff_len < in_result_data_buf_len) || (__peer_buff_len < (in_result_data_buf_len + 8))) return false;
+            if (!_get_packet(_RESULT_DATA_PACKET_MAGIC, _buff, in_result_data_buf_len, _get_long_timeout)) return false;
+            if (result_data) *result_data = _buff + 2;
+            if (result_data_len) *result_data_len = in_result_data_buf_len - 4;
+            return true;
+        }
+
+        // Avoid timeout livelocking.
+        _get_short_timeout = min((_get_short_timeout * 6) / 4, recv_timeout);
+    }
+
+    // Nothing is coming back so everything still in flight has been lost.
+    __pipeline_outstanding = 0;
+    _flush();
+    return false;
+}
+
+bool rpc_master::__call_delta(uint32_t command, uint8_t *data, size_t size, uint8_t *result, size_t *result_size, size_t result_max,
+                              unsigned long send_timeout, unsigned long recv_timeout)
+{
+    uint8_t *out;
+    size_t out_size;
+
+    // Slaves without delta support just get a regular call.
+    if (!(__capabilities & RPC_CAPABILITY_DELTA)) {
+        if ((!__call(command, data, size, &out, &out_size, send_timeout, recv_timeout)) || (out_size > result_max)) return false;
+        memcpy(result, out, out_size);
+        *result_size = out_size;
+        return true;
+    }
+
+    // A delta that does not rebuild the result the slave tagged is asked for again in full.
+    for (int retry = 0; retry < 2; retry++) {
+        const uint32_t header[2] = {command, retry ? 0 : _tag(result, *result_size)};
+        if (_buff_len < (16 + sizeof(header) + size)) return false;
+        memcpy(_buff + 14, header, sizeof(header));
+        if (size) memmove(_buff + 14 + sizeof(header), data, size);
+        if (!__call(_hash(_DELTA_COMMAND), _buff + 14, sizeof(header) + size, &out, &out_size, send_timeout, recv_timeout)) return false;
+        if (!out_size) return false;
+
+        if (!out[0]) {
+            if ((out_size - 1) > result_max) return false;
+            memcpy(result, out + 1, out_size - 1);
+            *result_size = out_size - 1;
+            return true;
+        }
+
+        if (out_size < 9) return false;
+        uint32_t tag = unpack_unsigned_long(out + 1);
+        uint32_t len = unpack_unsigned_long(out + 5);
+        if (len > result_max) return false;
+        if (len > *result_size) memset(result + *result_size, 0, len - *result_size);
+        *result_size = len;
+        if (xor_rle_decode(out + 9, out_size - 9, result, len) && (_tag(result, len) == tag)) return true;
+    }
+
+    return false;
+}
+
+bool rpc_master::call_delta(const __FlashStringHelper *name,
+                            void *command_data, size_t command_data_len,
+                            void *result_data, size_t *result_data_len, size_t result_data_max,
+                            unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __call_delta(_hash(name), (uint8_t *) command_data, command_data_len,
+                        (uint8_t *) result_data, result_data_len, result_data_max, send_timeout, recv_timeout);
+}
+
+bool rpc_master::call_delta(const String &name,
+                            void *command_data, size_t command_data_len,
+                            void *result_data, size_t *result_data_len, size_t result_data_max,
+                            unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __call_delta(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len,
+                        (uint8_t *) result_data, result_data_len, result_data_max, send_timeout, recv_timeout);
+}
+
+bool rpc_master::call_delta(const char *name,
+                            void *command_data, size_t command_data_len,
+                            void *result_data, size_t *result_data_len, size_t result_data_max,
+                            unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __call_delta(_hash(name), (uint8_t *) command_data, command_data_len,
+                        (uint8_t *) result_data, result_data_len, result_data_max, send_timeout, recv_timeout);
+}
+
+bool rpc_master::__call_conditional(uint32_t command, uint8_t *data, size_t size, uint8_t *result, size_t *result_size, size_t result_max,
+                                    bool *modified, unsigned long send_timeout, unsigned long recv_timeout)
+{
+    const uint32_t header[2] = {command, _tag(result, *result_size)};
+    bool conditional = __capabilities & RPC_CAPABILITY_CONDITIONAL;
+    uint8_t *out;
+    size_t out_size;
+
+    if (conditional) {
+        if (_buff_len < (16 + sizeof(header) + size)) return false;
+        memcpy(_buff + 14, header, sizeof(header));
+        if (size) memmove(_buff + 14 + sizeof(header), data, size);
+    }
+
+    // Slaves without conditional support always send the result.
+    __not_modified = false;
+    if (!(conditional ? __call(_hash(_CONDITIONAL_COMMAND), _buff + 14, sizeof(header) + size, &out, &out_size, send_timeout, recv_timeout)
+                      : __call(command, data, size, &out, &out_size, send_timeout, recv_timeout))) return false;
+    if (modified) *modified = !__not_modified;
+    if (__not_modified) return true;
+    if (out_size > result_max) return false;
+    memcpy(result, out, out_size);
+    *result_size = out_size;
+    return true;
+}
+
+bool rpc_master::call_conditional(const __FlashStringHelper *name,
+                                  void *command_data, size_t command_data_len,
+                                  void *result_data, size_t *result_data_len, size_t result_data_max, bool *modified,
+                                  unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __call_conditional(_hash(name), (uint8_t *) command_data, command_data_len,
+                              (uint8_t *) result_data, result_data_len, result_data_max, modified, send_timeout, recv_timeout);
+}
+
+bool rpc_master::call_conditional(const String &name,
+                                  void *command_data, size_t command_data_len,
+                                  void *result_data, size_t *result_data_len, size_t result_data_max, bool *modified,
+                                  unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __call_conditional(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len,
+                              (uint8_t *) result_data, result_data_len, result_data_max, modified, send_timeout, recv_timeout);
+}
+
+bool rpc_master::call_conditional(const char *name,
+                                  void *command_data, size_t command_data_len,
+                                  void *result_data, size_t *result_data_len, size_t result_data_max, bool *modified,
+                                  unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __call_conditional(_hash(name), (uint8_t *) command_data, command_data_len,
+                              (uint8_t *) result_data, result_data_len, result_data_max, modified, send_timeout, recv_timeout);
+}
+
+void rpc_master::set_event_callback_dict(rpc_event_callback_entry_t *event_callback_dict, size_t event_callback_dict_len)
+{
+    __event_dict = event_callback_dict;
+    __event_dict_len = event_callback_dict_len;
+    __event_dict_alloced = 0;
+}
+
+bool rpc_master::__register_event_callback(uint32_t event, rpc_event_callback_t callback)
+{
+    for (size_t i = 0; i < __event_dict_alloced; i++) {
+        if (__event_dict[i].key == event) {
+            __event_dict[i].value = callback;
+            return true;
+        }
+    }
+
+    if (__event_dict_alloced < __event_dict_len) {
+        __event_dict[__event_dict_alloced].key = event;
+        __event_dict[__event_dict_alloced++].value = callback;
+        return true;
+    }
+
+    return false;
+}
+
+bool rpc_master::register_event_callback(const __FlashStringHelper *name, rpc_event_callback_t callback)
+{
+    return __register_event_callback(_hash(name), callback);
+}
+
+bool rpc_master::register_event_callback(const String &name, rpc_event_callback_t callback)
+{
+    return __register_event_callback(_hash(name.c_str(), name.length()), callback);
+}
+
+bool rpc_master::register_event_callback(const char *name, rpc_event_callback_t callback)
+{
+    return __register_event_callback(_hash(name), callback);
+}
+
+bool rpc_master::poll_events(unsigned long send_timeout, unsigned long recv_timeout)
+{
+    if (!(__capabilities & RPC_CAPABILITY_EVENTS)) return false;
+
+    // Each fetch acknowledges every event received so far so events in a lost result are sent again.
+    // Only one fetch is made so a slave that keeps pushing events cannot hold the master here.
+    uint8_t *result;
+    size_t result_size;
+    const uint32_t ack[1] = {__events_received};
+    if (!__call(_hash(_EVENTS_COMMAND), (uint8_t *) ack, sizeof(ack), &result, &result_size, send_timeout, recv_timeout)) return false;
+
+    for (size_t offset = 0; (offset + 8) <= result_size;) {
+        uint32_t event = unpack_unsigned_long(result + offset);
+        uint32_t len = unpack_unsigned_long(result + offset + 4);
+        if ((result_size - offset - 8) < len) return false;
+
+        for (size_t i = 0; i < __event_dict_alloced; i++) {
+            if ((__event_dict[i].key == event) && __event_dict[i].value) {
+                __event_dict[i].value(result + offset + 8, len);
+                break;
+            }
+        }
+
+        offset += 8 + len;
+        __events_received += 1;
+    }
+
+    return true;
+}
+
+bool rpc_master::__subscribe(uint32_t command, uint8_t *data, size_t size, unsigned long period,
+                             rpc_stream_reader_callback_t callback, unsigned long queue_depth, unsigned long read_timeout,
+                             unsigned long send_timeout, unsigned long recv_timeout)
+{
+    const uint32_t header[2] = {command, period};
+    uint8_t *result;
+    size_t result_size;
+    if ((!(__capabilities & RPC_CAPABILITY_SUBSCRIBE)) || (_buff_len < (16 + sizeof(header) + size))) return false;
+    memcpy(_buff + 14, header, sizeof(header));
+    if (size) memmove(_buff + 14 + sizeof(header), data, size);
+    if (!__call(_hash(_SUBSCRIBE_COMMAND), _buff + 14, sizeof(header) + size, &result, &result_size,
+                send_timeout, recv_timeout)) return false;
+    if ((result_size != 1) || (!result[0])) return false;
+    stream_reader(callback, queue_depth, read_timeout);
+    return true;
+}
+
+bool rpc_master::subscribe(const __FlashStringHelper *name, void *command_data, size_t command_data_len, unsigned long period,
+                           rpc_stream_reader_callback_t callback, unsigned long queue_depth, unsigned long read_timeout,
+                           unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __subscribe(_hash(name), (uint8_t *) command_data, command_data_len, period, callback, queue_depth, read_timeout,
+                       send_timeout, recv_timeout);
+}
+
+bool rpc_master::subscribe(const String &name, void *command_data, size_t command_data_len, unsigned long period,
+                           rpc_stream_reader_callback_t callback, unsigned long queue_depth, unsigned long read_timeout,
+                           unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __subscribe(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len, period,
+                       callback, queue_depth, read_timeout, send_timeout, recv_timeout);
+}
+
+bool rpc_master::subscribe(const char *name, void *command_data, size_t command_data_len, unsigned long period,
+                           rpc_stream_reader_callback_t callback, unsigned long queue_depth, unsigned long read_timeout,
+                           unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __subscribe(_hash(name), (uint8_t *) command_data, command_data_len, period, callback, queue_depth, read_timeout,
+                       send_timeout, recv_timeout);
+}
+
+bool rpc_master::stream_call(const __FlashStringHelper *name, void *command_data, size_t command_data_len,
+                             rpc_stream_reader_callback_t result_callback)
+{
+    return _stream_put_call(_hash(name), (uint8_t *) command_data, command_data_len, result_callback);
+}
+
+bool rpc_master::stream_call(const String &name, void *command_data, size_t command_data_len,
+                             rpc_stream_reader_callback_t result_callback)
+{
+    return _stream_put_call(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len, result_callback);
+}
+
+bool rpc_master::stream_call(const char *name, void *command_data, size_t command_data_len,
+                             rpc_stream_reader_callback_t result_callback)
+{
+    return _stream_put_call(_hash(name), (uint8_t *) command_data, command_data_len, result_callback);
+}
+
+void rpc_master::batch_begin()
+{
+    __batch_count = 0;
+    __batch_size = 0;
+    __batch_result = NULL;
+    __batch_result_size = 0;
+}
+
+// Batch entries and results live in _buff so any other command sent ends the batch. batch_call()
+// and batch_result() then fail instead of sending or returning whatever overwrote them.
+void rpc_master::__batch_end(uint32_t command)
+{
+    if (command != _hash(_BATCH_COMMAND)) batch_begin();
+}
+
+bool rpc_master::__batch_add(uint32_t command, uint8_t *data, size_t size)
+{
+    // Entries are packed where a fast frame carries its payload so nothing is copied twice.
+    const uint32_t header[2] = {command, size};
+    uint8_t *entry = _buff + 14 + __batch_size;
+    if (_buff_len < (16 + __batch_size + sizeof(header) + size)) return false;
+    memcpy(entry, header, sizeof(header));
+    if (size) memcpy(entry + sizeof(header), data, size);
+    __batch_size += sizeof(header) + size;
+    __batch_count += 1;
+    return true;
+}
 
-        if (credits > 0) {
-            uint8_t *out_data;
-            uint32_t out_data_len;
-            callback(&out_data, &out_data_len);
-            _set_packet(packet, 0x542E, (uint8_t *) &out_data_len, sizeof(out_data_len));
-            if (!_stream_put_bytes(packet, sizeof(packet), 1000)) return;
-            if (!_stream_put_bytes(out_data, out_data_len, write_timeout)) return;
-            credits -= 1;
-        }
-    }
+bool rpc_master::batch_add(const __FlashStringHelper *name, void *command_data, size_t command_data_len)
+{
+    return __batch_add(_hash(name), (uint8_t *) command_data, command_data_len);
 }
 
-bool rpc::_stream_get_bytes(uint8_t *buff, size_t size, unsigned long timeout)
+bool rpc_master::batch_add(const String &name, void *command_data, size_t command_data_len)
 {
-    return get_bytes(buff, size, timeout);
+    return __batch_add(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len);
 }
 
-bool rpc::_stream_put_bytes(uint8_t *data, size_t size, unsigned long timeout)
+bool rpc_master::batch_add(const char *name, void *command_data, size_t command_data_len)
 {
-    return put_bytes(data, size, timeout);
+    return __batch_add(_hash(name), (uint8_t *) command_data, command_data_len);
 }
 
-rpc_master::rpc_master(uint8_t *buff, size_t buff_len) : rpc(buff, buff_len)
+bool rpc_master::batch_call(unsigned long send_timeout, unsigned long recv_timeout)
 {
-    _set_packet(__out_result_header_ack, _RESULT_HEADER_PACKET_MAGIC, NULL, 0);
-    _set_packet(__out_result_data_ack, _RESULT_DATA_PACKET_MAGIC, NULL, 0);
+    if ((!(__capabilities & RPC_CAPABILITY_BATCH)) || (!__batch_count)) return false;
+    bool result = __call(_hash(_BATCH_COMMAND), _buff + 14, __batch_size, &__batch_result, &__batch_result_size,
+                         send_timeout, recv_timeout);
+    // The entries were consumed by the call so another batch must start from scratch.
+    __batch_size = 0;
+    if (!result) batch_begin();
+    return result;
 }
 
-bool rpc_master::__put_command(uint32_t command, uint8_t *data, size_t size, unsigned long timeout)
+bool rpc_master::batch_result(size_t index, void **result_data, size_t *result_data_len)
 {
-    const uint32_t header[2] = {command, size};
-    uint8_t out_header[12];
-    if (_buff_len < (size + 4)) return false;
-    _put_short_timeout = _put_short_timeout_reset;
-    _get_short_timeout = _get_short_timeout_reset;
-    _set_packet(out_header, _COMMAND_HEADER_PACKET_MAGIC, (uint8_t *) header, 8);
-    _set_packet(_buff, _COMMAND_DATA_PACKET_MAGIC, data, size);
-    unsigned long start = millis();
+    uint8_t *entry = __batch_result;
+    uint8_t *end = __batch_result + __batch_result_size;
+    if ((!__batch_result) || (index >= __batch_count)) return false;
 
-    while ((millis() - start) < timeout) {
-        _zero(__in_command_header_buf, sizeof(__in_command_header_buf));
-        _zero(__in_command_data_buf, sizeof(__in_command_data_buf));
-        _flush();
-        put_bytes(out_header, sizeof(out_header), _put_short_timeout);
-        if (_get_packet(_COMMAND_HEADER_PACKET_MAGIC, __in_command_header_buf, sizeof(__in_command_header_buf), _get_short_timeout)) {
-            put_bytes(_buff, size + 4, _put_long_timeout);
-            if (_get_packet(_COMMAND_DATA_PACKET_MAGIC, __in_command_data_buf, sizeof(__in_command_data_buf), _get_short_timeout)) {
-                return true;
-            }
+    for (size_t i = 0; (entry + sizeof(uint32_t)) <= end; i++) {
+        uint32_t len = unpack_unsigned_long(entry);
+        if ((size_t) (end - entry - sizeof(uint32_t)) < len) return false;
+
+        if (i == index) {
+            *result_data = entry + sizeof(uint32_t);
+            *result_data_len = len;
+            return true;
         }
 
-        // Avoid timeout livelocking.
-        _put_short_timeout = min((_put_short_timeout * 6) / 4, timeout);
-        _get_short_timeout = min((_get_short_timeout * 6) / 4, timeout);
+        entry += sizeof(uint32_t) + len;
     }
 
     return false;
 }
 
-bool rpc_master::__get_result(uint8_t **data, size_t *size, unsigned long timeout)
+bool rpc_master::call_chunked(const __FlashStringHelper *name,
+                              void *command_data, size_t command_data_len, rpc_chunk_callback_t result_callback,
+                              unsigned long send_timeout, unsigned long recv_timeout)
 {
-    _put_short_timeout = _put_short_timeout_reset;
-    _get_short_timeout = _get_short_timeout_reset;
-    unsigned long start = millis();
+    return __put_command(_hash(name), (uint8_t *) command_data, command_data_len, send_timeout)
+        ? __get_result(NULL, NULL, recv_timeout, result_callback) : false;
+}
 
-    while ((millis() - start) < timeout) {
-        _zero(__in_result_header_buf, sizeof(__in_result_header_buf));
-        _flush();
-        put_bytes(__out_result_header_ack, sizeof(__out_result_header_ack), _put_short_timeout);
-        if (_get_packet(_RESULT_HEADER_PACKET_MAGIC, __in_result_header_buf, sizeof(__in_result_header_buf), _get_short_timeout)) {
-            uint32_t in_result_data_buf_len = unpack_unsigned_long(__in_result_header_buf + 2) + 4;
-            if (_buff_len < in_result_data_buf_len) return false;
-            put_bytes(__out_result_data_ack, sizeof(__out_result_data_ack), _put_short_timeout);
-            if (_get_packet(_RESULT_DATA_PACKET_MAGIC, _buff, in_result_data_buf_len, _get_long_timeout)) {
-                *data = _buff + 2;
-                *size = in_result_data_buf_len - 4;
-                return true;
-            }
-        }
+bool rpc_master::call_chunked(const String &name,
+                              void *command_data, size_t command_data_len, rpc_chunk_callback_t result_callback,
+                              unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __put_command(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len, send_timeout)
+        ? __get_result(NULL, NULL, recv_timeout, result_callback) : false;
+}
 
-        // Avoid timeout livelocking.
-        _put_short_timeout = min((_put_short_timeout * 6) / 4, timeout);
-        _get_short_timeout = min((_get_short_timeout * 6) / 4, timeout);
-    }
+bool rpc_master::call_chunked(const char *name,
+                              void *command_data, size_t command_data_len, rpc_chunk_callback_t result_callback,
+                              unsigned long send_timeout, unsigned long recv_timeout)
+{
+    return __put_command(_hash(name), (uint8_t *) command_data, command_data_len, send_timeout)
+        ? __get_result(NULL, NULL, recv_timeout, result_callback) : false;
+}
 
-    return false;
+bool rpc_master::negotiate(uint32_t capabilities, unsigned long send_timeout, unsigned long recv_timeout)
+{
+    const uint32_t offer[4] = {capabilities & _transport_capabilities(), _buff_len, _mtu, _dictionary_id()};
+    uint8_t *result;
+    size_t result_size;
+    _skip_crc = false;
+    _dictionary_shared = false;
+    __capabilities = 0;
+    __peer_buff_len = 0;
+    _peer_mtu = 0;
+
+    // Always use the legacy exchange here as the slave may not support anything else.
+    if (!__put_command(_hash(_CAPABILITIES_COMMAND), (uint8_t *) offer, sizeof(offer), send_timeout)) return false;
+    if (!__get_result(&result, &result_size, recv_timeout)) return false;
+    if (result_size >= sizeof(uint32_t)) __capabilities = unpack_unsigned_long(result) & offer[0];
+    if (result_size >= (2 * sizeof(uint32_t))) __peer_buff_len = unpack_unsigned_long(result + 4);
+    if (result_size >= (3 * sizeof(uint32_t))) _peer_mtu = unpack_unsigned_long(result + 8);
+    _dictionary_shared = (result_size >= (4 * sizeof(uint32_t))) && offer[3] && (unpack_unsigned_long(result + 12) == offer[3]);
+    if (__peer_buff_len <= 8) __capabilities &= ~RPC_CAPABILITY_CHUNKED;
+    _skip_crc = __capabilities & RPC_CAPABILITY_NO_CRC;
+    return true;
 }
 
 bool rpc_master::call_no_copy_no_args(const __FlashStringHelper *name,
                                       void **result_data, size_t *result_data_len, 
                                       unsigned long send_timeout, unsigned long recv_timeout)
 {
-    return __put_command(_hash(name), NULL, 0, send_timeout)
-        ? __get_result((uint8_t **) result_data, result_data_len, recv_timeout) : false;
+    return __call(_hash(name), NULL, 0, (uint8_t **) result_data, result_data_len,
+                  send_timeout, recv_timeout);
 }
 
 bool rpc_master::call_no_copy_no_args(const String &name,
                                       void **result_data, size_t *result_data_len, 
                                       unsigned long send_timeout, unsigned long recv_timeout)
 {
-    return __put_command(_hash(name.c_str(), name.length()), NULL, 0, send_timeout)
-        ? __get_result((uint8_t **) result_data, result_data_len, recv_timeout) : false;
+    return __call(_hash(name.c_str(), name.length()), NULL, 0, (uint8_t **) result_data, result_data_len,
+                  send_timeout, recv_timeout);
 }
 
 bool rpc_master::call_no_copy_no_args(const char *name,
                                       void **result_data, size_t *result_data_len, 
                                       unsigned long send_timeout, unsigned long recv_timeout)
 {
-    return __put_command(_hash(name), NULL, 0, send_timeout)
-        ? __get_result((uint8_t **) result_data, result_data_len, recv_timeout) : false;
+    return __call(_hash(name), NULL, 0, (uint8_t **) result_data, result_data_len,
+                  send_timeout, recv_timeout);
 }
 
 bool rpc_master::call_no_copy(const __FlashStringHelper *name,
@@ -329,8 +2196,8 @@ bool rpc_master::call_no_copy(const __FlashStringHelper *name,
                               void **result_data, size_t *result_data_len, 
                               unsigned long send_timeout, unsigned long recv_timeout)
 {
-    return __put_command(_hash(name), (uint8_t *) command_data, command_data_len, send_timeout)
-        ? __get_result((uint8_t **) result_data, result_data_len, recv_timeout) : false;
+    return __call(_hash(name), (uint8_t *) command_data, command_data_len, (uint8_t **) result_data, result_data_len,
+                  send_timeout, recv_timeout);
 }
 
 bool rpc_master::call_no_copy(const String &name,
@@ -338,8 +2205,8 @@ bool rpc_master::call_no_copy(const String &name,
                               void **result_data, size_t *result_data_len, 
                               unsigned long send_timeout, unsigned long recv_timeout)
 {
-    return __put_command(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len, send_timeout)
-        ? __get_result((uint8_t **) result_data, result_data_len, recv_timeout) : false;
+    return __call(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len, (uint8_t **) result_data, result_data_len,
+                  send_timeout, recv_timeout);
 }
 
 bool rpc_master::call_no_copy(const char *name,
@@ -347,8 +2214,8 @@ bool rpc_master::call_no_copy(const char *name,
                               void **result_data, size_t *result_data_len, 
                               unsigned long send_timeout, unsigned long recv_timeout)
 {
-    return __put_command(_hash(name), (uint8_t *) command_data, command_data_len, send_timeout)
-        ? __get_result((uint8_t **) result_data, result_data_len, recv_timeout) : false;
+    return __call(_hash(name), (uint8_t *) command_data, command_data_len, (uint8_t **) result_data, result_data_len,
+                  send_timeout, recv_timeout);
 }
 
 bool rpc_master::call_no_args(const __FlashStringHelper *name,
@@ -357,8 +2224,8 @@ bool rpc_master::call_no_args(const __FlashStringHelper *name,
 {
     void *result_pointer;
     size_t result_size;
-    bool result = __put_command(_hash(name), NULL, 0, send_timeout)
-        ? __get_result((uint8_t **) &result_pointer, &result_size, recv_timeout) : false;
+    bool result = __call(_hash(name), NULL, 0, (uint8_t **) &result_pointer, &result_size,
+                         send_timeout, recv_timeout);
     if (return_false_if_received_data_is_zero) result = result && result_size;
     if (result) memcpy(result_data, result_pointer, min(result_data_len, result_size));
     else memset(result_data, 0, result_data_len);
@@ -371,8 +2238,8 @@ bool rpc_master::call_no_args(const String &name,
 {
     void *result_pointer;
     size_t result_size;
-    bool result = __put_command(_hash(name.c_str(), name.length()), NULL, 0, send_timeout)
-        ? __get_result((uint8_t **) &result_pointer, &result_size, recv_timeout) : false;
+    bool result = __call(_hash(name.c_str(), name.length()), NULL, 0, (uint8_t **) &result_pointer, &result_size,
+                         send_timeout, recv_timeout);
     if (return_false_if_received_data_is_zero) result = result && result_size;
     if (result) memcpy(result_data, result_pointer, min(result_data_len, result_size));
     else memset(result_data, 0, result_data_len);
@@ -385,8 +2252,8 @@ bool rpc_master::call_no_args(const char *name,
 {
     void *result_pointer;
     size_t result_size;
-    bool result = __put_command(_hash(name), NULL, 0, send_timeout)
-        ? __get_result((uint8_t **) &result_pointer, &result_size, recv_timeout) : false;
+    bool result = __call(_hash(name), NULL, 0, (uint8_t **) &result_pointer, &result_size,
+                         send_timeout, recv_timeout);
     if (return_false_if_received_data_is_zero) result = result && result_size;
     if (result) memcpy(result_data, result_pointer, min(result_data_len, result_size));
     else memset(result_data, 0, result_data_len);
@@ -400,8 +2267,8 @@ bool rpc_master::call(const __FlashStringHelper *name,
 {
     void *result_pointer;
     size_t result_size;
-    bool result = __put_command(_hash(name), (uint8_t *) command_data, command_data_len, send_timeout)
-        ? __get_result((uint8_t **) &result_pointer, &result_size, recv_timeout) : false;
+    bool result = __call(_hash(name), (uint8_t *) command_data, command_data_len, (uint8_t **) &result_pointer, &result_size,
+                         send_timeout, recv_timeout);
     if (return_false_if_received_data_is_zero) result = result && result_size;
     if (result) memcpy(result_data, result_pointer, min(result_data_len, result_size));
     else memset(result_data, 0, result_data_len);
@@ -415,8 +2282,8 @@ bool rpc_master::call(const String &name,
 {
     void *result_pointer;
     size_t result_size;
-    bool result = __put_command(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len, send_timeout)
-        ? __get_result((uint8_t **) &result_pointer, &result_size, recv_timeout) : false;
+    bool result = __call(_hash(name.c_str(), name.length()), (uint8_t *) command_data, command_data_len, (uint8_t **) &result_pointer, &result_size,
+                         send_timeout, recv_timeout);
     if (return_false_if_received_data_is_zero) result = result && result_size;
     if (result) memcpy(result_data, result_pointer, min(result_data_len, result_size));
     else memset(result_data, 0, result_data_len);
@@ -430,8 +2297,8 @@ bool rpc_master::call(const char *name,
 {
     void *result_pointer;
     size_t result_size;
-    bool result = __put_command(_hash(name), (uint8_t *) command_data, command_data_len, send_timeout)
-        ? __get_result((uint8_t **) &result_pointer, &result_size, recv_timeout) : false;
+    bool result = __call(_hash(name), (uint8_t *) command_data, command_data_len, (uint8_t **) &result_pointer, &result_size,
+                         send_timeout, recv_timeout);
     if (return_false_if_received_data_is_zero) result = result && result_size;
     if (result) memcpy(result_data, result_pointer, min(result_data_len, result_size));
     else memset(result_data, 0, result_data_len);
@@ -444,6 +2311,14 @@ rpc_slave::rpc_slave(uint8_t *buff, size_t buff_len, rpc_callback_entry_t *callb
     __dict_len = callback_dict_len;
     _set_packet(__out_command_header_ack, _COMMAND_HEADER_PACKET_MAGIC, NULL, 0);
     _set_packet(__out_command_data_ack, _COMMAND_DATA_PACKET_MAGIC, NULL, 0);
+    _set_packet(__out_command_data_nak, _NAK_PACKET_MAGIC, NULL, 0);
+    _zero(__out_fast_command_nak, sizeof(__out_fast_command_nak));
+    _set_packet(__out_fast_command_nak, _NAK_PACKET_MAGIC, __out_fast_command_nak + 2, sizeof(__out_fast_command_nak) - 4);
+    __fast = false;
+    __pipelined = false;
+    __seq = 0;
+    __last_result_len = 0;
+    __not_modified = false;
 }
 
 bool rpc_slave::__get_command(uint32_t *command, uint8_t **data, size_t *size, unsigned long timeout)
@@ -451,21 +2326,79 @@ bool rpc_slave::__get_command(uint32_t *command, uint8_t **data, size_t *size, u
     _put_short_timeout = _put_short_timeout_reset;
     _get_short_timeout = _get_short_timeout_reset;
     unsigned long start = millis();
+    // A fast master sends its next frame right after the last result and a NAK for the
+    // last result may already be waiting so don't drop either.
+    bool flush = !(__fast || __last_result_len);
 
     while ((millis() - start) < timeout) {
         _zero(__in_command_header_buf, sizeof(__in_command_header_buf));
-        _flush();
-        if (_get_packet(_COMMAND_HEADER_PACKET_MAGIC, __in_command_header_buf, sizeof(__in_command_header_buf), _get_short_timeout)) {
-            uint32_t cmd = unpack_unsigned_long(__in_command_header_buf + 2);
-            uint32_t in_command_data_buf_len = unpack_unsigned_long(__in_command_header_buf + 6) + 4;
-            if (_buff_len < in_command_data_buf_len) return false;
-            put_bytes(__out_command_header_ack, sizeof(__out_command_header_ack), _put_short_timeout);
-            if (_get_packet(_COMMAND_DATA_PACKET_MAGIC, _buff, in_command_data_buf_len, _get_long_timeout)) {
-               put_bytes(__out_command_data_ack, sizeof(__out_command_data_ack), _put_short_timeout);
-               *command = cmd;
-               *data = _buff + 2;
-               *size = in_command_data_buf_len - 4;
-               return true;
+        if (flush) _flush();
+        flush = true;
+        if (get_bytes(__in_command_header_buf, sizeof(__in_command_header_buf), _get_short_timeout)) {
+            bool pipelined = _check_packet(_PIPELINED_COMMAND_PACKET_MAGIC, __in_command_header_buf, sizeof(__in_command_header_buf));
+            bool fast = pipelined || _check_packet(_FAST_COMMAND_PACKET_MAGIC, __in_command_header_buf, sizeof(__in_command_header_buf));
+            if (__last_result_len && _check_packet(_NAK_PACKET_MAGIC, __in_command_header_buf, sizeof(__in_command_header_buf))) {
+                // The master lost the last result so send it again without rerunning the callback.
+                put_bytes(_buff, __last_result_len, _put_long_timeout);
+                flush = false;
+                continue;
+            }
+
+            if (fast || _check_packet(_COMMAND_HEADER_PACKET_MAGIC, __in_command_header_buf, sizeof(__in_command_header_buf))) {
+                uint32_t cmd = unpack_unsigned_long(__in_command_header_buf + 2);
+                uint32_t in_command_header = unpack_unsigned_long(__in_command_header_buf + 6);
+                bool compressed = (!pipelined) && (in_command_header & _COMPRESSED_LENGTH);
+                uint32_t in_command_data_buf_len = (pipelined ? (in_command_header & 0xFFFF) : (in_command_header & ~_COMPRESSED_LENGTH)) + 4;
+                __last_result_len = 0; // _buff is about to be overwritten.
+
+                // Commands that do not fit are handed to a chunk callback and the regular
+                // callback is then run with no data (0 bytes) to produce the result.
+                if ((!fast) && __chunked(in_command_data_buf_len - 4)) {
+                    if (!__get_command_chunks(cmd, in_command_data_buf_len - 4, timeout)) return false;
+                    __fast = false;
+                    __pipelined = false;
+                    *command = cmd;
+                    *data = _buff;
+                    *size = 0;
+                    return true;
+                }
+
+                if (_buff_len < in_command_data_buf_len) return false;
+                if (!fast) put_bytes(__out_command_header_ack, sizeof(__out_command_header_ack), _put_short_timeout);
+
+                if ((!fast) && __fragmented(in_command_data_buf_len - 4)) {
+                    if (!_get_fragments(in_command_data_buf_len - 4, timeout)) return false;
+                    __fast = false;
+                    __pipelined = false;
+                    *command = cmd;
+                    *data = _buff + 2;
+                    *size = in_command_data_buf_len - 4;
+                    return (!compressed) || _decompress(*data, size);
+                }
+
+                for (;;) {
+                    if (_get_packet(_COMMAND_DATA_PACKET_MAGIC, _buff, in_command_data_buf_len, _get_long_timeout)) {
+                       if (!fast) put_bytes(__out_command_data_ack, sizeof(__out_command_data_ack), _put_short_timeout);
+                       __fast = fast;
+                       __pipelined = pipelined;
+                       __seq = pipelined ? (in_command_header >> 16) : 0;
+                       *command = cmd;
+                       *data = _buff + 2;
+                       *size = in_command_data_buf_len - 4;
+                       return (!compressed) || _decompress(*data, size);
+                    }
+
+                    // Ask for the data packet again instead of waiting for the whole exchange.
+                    // A fast master resends its whole frame and a pipelined one cannot be asked.
+                    if ((!(__capabilities & RPC_CAPABILITY_NAK)) || pipelined) break;
+                    _flush();
+                    if (fast) {
+                        put_bytes(__out_fast_command_nak, sizeof(__out_fast_command_nak), _put_short_timeout);
+                        break;
+                    }
+                    if ((millis() - start) >= timeout) break;
+                    put_bytes(__out_command_data_nak, sizeof(__out_command_data_nak), _put_short_timeout);
+                }
             }
         }
 
@@ -477,15 +2410,155 @@ bool rpc_slave::__get_command(uint32_t *command, uint8_t **data, size_t *size, u
     return false; 
 }
 
+bool rpc_slave::__chunked(size_t size)
+{
+    return (__capabilities & RPC_CAPABILITY_CHUNKED) && ((size + 4) > min(_buff_len, __peer_buff_len));
+}
+
+bool rpc_slave::__fragmented(size_t size)
+{
+    return (__capabilities & RPC_CAPABILITY_FRAGMENTS) && (size > _fragment_size(size));
+}
+
+bool rpc_slave::__get_command_chunks(uint32_t command, uint32_t size, unsigned long timeout)
+{
+    rpc_chunk_callback_t callback = NULL;
+
+    for (size_t i = 0; i < __chunk_dict_alloced; i++) {
+        if (__chunk_dict[i].key == command) {
+            callback = __chunk_dict[i].value;
+            break;
+        }
+    }
+
+    // Leaving the header unacked makes the master give up.
+    if (!callback) return false;
+    put_bytes(__out_command_header_ack, sizeof(__out_command_header_ack), _put_short_timeout);
+    size_t chunk_size = _chunk_size(__peer_buff_len);
+    uint32_t expected = 0;
+    uint8_t out_ack[8];
+    _put_short_timeout = _put_short_timeout_reset;
+    _get_short_timeout = _get_short_timeout_reset;
+    unsigned long start = millis();
+
+    while ((expected < size) && ((millis() - start) < timeout)) {
+        // The offset is read first so that a resent chunk can be read at its own length.
+        if (get_bytes(_buff, 6, _get_short_timeout)) {
+            uint32_t offset = unpack_unsigned_long(_buff + 2);
+
+            if ((offset < size) && (!(offset % chunk_size))) {
+                size_t len = min(chunk_size, size - offset);
+
+                if (get_bytes(_buff + 6, len + 2, _get_long_timeout) && _check_packet(_COMMAND_CHUNK_PACKET_MAGIC, _buff, len + 8)) {
+                    // Chunks whose ack was lost are acked again but only delivered once.
+                    if (offset == expected) {
+                        callback(_buff + 6, len, offset, size);
+                        expected += len;
+                    }
+
+                    if (offset < expected) {
+                        _set_packet(out_ack, _COMMAND_CHUNK_PACKET_MAGIC, (uint8_t *) &offset, sizeof(offset));
+                        put_bytes(out_ack, sizeof(out_ack), _put_short_timeout);
+                        _get_short_timeout = _get_short_timeout_reset;
+                        start = millis();
+                    }
+
+                    continue;
+                }
+            }
+        }
+
+        // Avoid timeout livelocking.
+        _flush();
+        _get_short_timeout = min(_get_short_timeout + 1, timeout);
+    }
+
+    return expected == size;
+}
+
+bool rpc_slave::__put_result_chunks(uint8_t *data, size_t size, unsigned long timeout)
+{
+    size_t chunk_size = _chunk_size(__peer_buff_len);
+    uint8_t in_request[8];
+    _put_short_timeout = _put_short_timeout_reset;
+    _get_short_timeout = _get_short_timeout_reset;
+    unsigned long start = millis();
+
+    // Chunks are served in whatever order the master asks for them until it asks past the end.
+    while ((millis() - start) < timeout) {
+        if (_get_packet(_RESULT_CHUNK_PACKET_MAGIC, in_request, sizeof(in_request), _get_short_timeout)) {
+            uint32_t offset = unpack_unsigned_long(in_request + 2);
+            if (offset >= size) return true;
+            size_t len = min(chunk_size, size - offset);
+            memcpy(_buff + 2, &offset, sizeof(offset));
+            memcpy(_buff + 6, data + offset, len);
+            _set_packet(_buff, _RESULT_CHUNK_PACKET_MAGIC, _buff + 2, len + 4);
+            put_bytes(_buff, len + 8, _put_long_timeout);
+            _get_short_timeout = _get_short_timeout_reset;
+            start = millis();
+            continue;
+        }
+
+        // Avoid timeout livelocking.
+        _flush();
+        _get_short_timeout = min(_get_short_timeout + 1, timeout);
+    }
+
+    return false;
+}
+
 bool rpc_slave::__put_result(uint8_t *data, size_t size, unsigned long timeout)
 {
-    const uint32_t header[1] = {size};
     uint8_t out_header[8];
-    if (_buff_len < (size + 4)) return false;
+
+    // Fast frames are answered with a single result frame and no handshake. The data
+    // packet is placed first as data may point into _buff (e.g. at the command payload).
+    if (__fast) {
+        // Results that do not fit a fast frame go back as the header alone, which the master can tell
+        // from our buffer length and fails on at once instead of resending the command.
+        if (_buff_len < (size + 12)) {
+            const uint32_t oversize_header[1] = {__pipelined ? (min(size, 0xFFFF) | (((uint32_t) __seq) << 16)) : size};
+            _set_packet(out_header, __pipelined ? _PIPELINED_RESULT_PACKET_MAGIC : _FAST_RESULT_PACKET_MAGIC,
+                        (uint8_t *) oversize_header, 4);
+            __last_result_len = 0;
+            put_bytes(out_header, sizeof(out_header), _put_long_timeout);
+            return false;
+        }
+
+        // The master keeps its copy so only the header goes back.
+        if (__not_modified && (!__pipelined)) {
+            const uint32_t not_modified_header[1] = {_NOT_MODIFIED_LENGTH};
+            _set_packet(_buff, _FAST_RESULT_PACKET_MAGIC, (uint8_t *) not_modified_header, 4);
+            __last_result_len = (__capabilities & RPC_CAPABILITY_NAK) ? 8 : 0;
+            return put_bytes(_buff, 8, _put_long_timeout);
+        }
+
+        bool compressed = (!__pipelined) && (__capabilities & RPC_CAPABILITY_COMPRESSION)
+                       && _compress(&data, &size, _buff + 10, __peer_buff_len);
+        const uint32_t header[1] = {compressed ? (size | _COMPRESSED_LENGTH) : size};
+        _set_packet(_buff + 8, _RESULT_DATA_PACKET_MAGIC, data, size);
+
+        if (__pipelined) {
+            const uint32_t pipelined_header[1] = {size | (((uint32_t) __seq) << 16)};
+            if (size > 0xFFFF) return false;
+            _set_packet(_buff, _PIPELINED_RESULT_PACKET_MAGIC, (uint8_t *) pipelined_header, 4);
+        } else {
+            _set_packet(_buff, _FAST_RESULT_PACKET_MAGIC, (uint8_t *) header, 4);
+        }
+
+        __last_result_len = ((__capabilities & RPC_CAPABILITY_NAK) && (!__pipelined)) ? (size + 12) : 0;
+        return put_bytes(_buff, size + 12, _put_long_timeout);
+    }
+
+    bool chunked = __chunked(size);
+    if ((!chunked) && (_buff_len < (size + 4))) return false;
+    bool compressed = (!chunked) && (__capabilities & RPC_CAPABILITY_COMPRESSION)
+                   && _compress(&data, &size, _buff + 2, __peer_buff_len);
+    const uint32_t header[1] = {__not_modified ? _NOT_MODIFIED_LENGTH : (compressed ? (size | _COMPRESSED_LENGTH) : size)};
     _put_short_timeout = _put_short_timeout_reset;
     _get_short_timeout = _get_short_timeout_reset;
     _set_packet(out_header, _RESULT_HEADER_PACKET_MAGIC, (uint8_t *) header, 4);
-    _set_packet(_buff, _RESULT_DATA_PACKET_MAGIC, data, size);
+    if (!chunked) _set_packet(_buff, _RESULT_DATA_PACKET_MAGIC, data, size);
     unsigned long start = millis();
 
     while ((millis() - start) < timeout) {
@@ -494,8 +2567,12 @@ bool rpc_slave::__put_result(uint8_t *data, size_t size, unsigned long timeout)
         _flush();
         if (_get_packet(_RESULT_HEADER_PACKET_MAGIC, __in_response_header_buf, sizeof(__in_response_header_buf), _get_short_timeout)) {
             put_bytes(out_header, sizeof(out_header), _put_short_timeout);
+            if (__not_modified) return true;
+            if (chunked) return __put_result_chunks(data, size, timeout);
             if (_get_packet(_RESULT_DATA_PACKET_MAGIC, __in_response_data_buf, sizeof(__in_response_data_buf), _get_short_timeout)) {
+                if (__fragmented(size)) return _put_fragments(size, timeout);
                 put_bytes(_buff, size + 4, _put_long_timeout);
+                __last_result_len = (__capabilities & RPC_CAPABILITY_NAK) ? (size + 4) : 0;
                 return true;
             }
         }
@@ -528,6 +2605,102 @@ bool rpc_slave::register_callback(const char *name, rpc_callback_t callback)
     return false;
 }
 
+void rpc_slave::set_chunk_callback_dict(rpc_chunk_callback_entry_t *chunk_callback_dict, size_t chunk_callback_dict_len)
+{
+    __chunk_dict = chunk_callback_dict;
+    __chunk_dict_len = chunk_callback_dict_len;
+    __chunk_dict_alloced = 0;
+}
+
+void rpc_slave::set_delta_dict(rpc_delta_entry_t *delta_dict, size_t delta_dict_len)
+{
+    __delta_dict = delta_dict;
+    __delta_dict_len = delta_dict_len;
+    __delta_dict_alloced = 0;
+}
+
+bool rpc_slave::register_delta_buffer(const char *name, void *buff, size_t buff_len)
+{
+    uint32_t hash = _hash(name);
+    rpc_delta_entry_t *entry = NULL;
+
+    for (size_t i = 0; (i < __delta_dict_alloced) && (!entry); i++) {
+        if (__delta_dict[i].key == hash) entry = __delta_dict + i;
+    }
+
+    if ((!entry) && (__delta_dict_alloced < __delta_dict_len)) entry = __delta_dict + __delta_dict_alloced++;
+    if (!entry) return false;
+    entry->key = hash;
+    entry->data = (uint8_t *) buff;
+    entry->data_max = buff_len;
+    entry->data_len = 0;
+    entry->tag = 0;
+    return true;
+}
+
+void rpc_slave::set_event_buffer(uint8_t *event_buff, size_t event_buff_len)
+{
+    __event_buff = event_buff;
+    __event_buff_len = event_buff_len;
+    __event_size = 0;
+    __event_count = 0;
+}
+
+void rpc_slave::set_event_pin(long event_pin)
+{
+    __event_pin = event_pin;
+
+    if (__event_pin >= 0) {
+        pinMode(__event_pin, OUTPUT);
+        digitalWrite(__event_pin, __event_count ? HIGH : LOW);
+    }
+}
+
+bool rpc_slave::push_event(const char *name, void *data, size_t data_len)
+{
+    const uint32_t header[2] = {_hash(name), data_len};
+    if ((__event_room() < (sizeof(header) + data_len)) || ((__event_buff_len - __event_size) < (sizeof(header) + data_len))) return false;
+    memcpy(__event_buff + __event_size, header, sizeof(header));
+    if (data_len) memcpy(__event_buff + __event_size + sizeof(header), data, data_len);
+    __event_size += sizeof(header) + data_len;
+    __event_count += 1;
+    if (__event_pin >= 0) digitalWrite(__event_pin, HIGH);
+    return true;
+}
+
+void rpc_slave::__pop_events(size_t count)
+{
+    size_t size = 0;
+
+    for (; count && (__event_count); count--, __event_count--) {
+        size += 8 + unpack_unsigned_long(__event_buff + size + 4);
+    }
+
+    memmove(__event_buff, __event_buff + size, __event_size - size);
+    __event_size -= size;
+    if ((__event_pin >= 0) && (!__event_count)) digitalWrite(__event_pin, LOW);
+}
+
+bool rpc_slave::register_chunk_callback(const char *name, rpc_chunk_callback_t callback)
+{
+    uint32_t hash = _hash(name);
+
+    for (size_t i = 0; i < __chunk_dict_alloced; i++) {
+        if (__chunk_dict[i].key == hash) {
+            __chunk_dict[i].value = callback;
+            return true;
+        }
+    }
+
+    if (__chunk_dict_alloced < __chunk_dict_len) {
+        __chunk_dict[__chunk_dict_alloced].key = hash;
+        __chunk_dict[__chunk_dict_alloced++].value = callback;
+        return true;
+    }
+
+    return false;
+}
+
 void rpc_slave::schedule_callback(rpc_plain_callback_t callback)
 {
     __schedule_cb = callback;
@@ -538,6 +2711,238 @@ void rpc_slave::setup_loop_callback(rpc_plain_callback_t callback)
     __loop_cb = callback;
 }
 
+void rpc_slave::__dispatch(uint32_t command, uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len)
+{
+    if (command == _hash(_CAPABILITIES_COMMAND)) {
+        uint32_t offer = (size >= sizeof(uint32_t)) ? unpack_unsigned_long(data) : 0;
+        __peer_buff_len = (size >= (2 * sizeof(uint32_t))) ? unpack_unsigned_long(data + 4) : 0;
+        _peer_mtu = (size >= (3 * sizeof(uint32_t))) ? unpack_unsigned_long(data + 8) : 0;
+        _dictionary_shared = (size >= (4 * sizeof(uint32_t))) && _dictionary_id() && (unpack_unsigned_long(data + 12) == _dictionary_id());
+        __capabilities = offer & __capabilities_offered & _transport_capabilities();
+        if (__peer_buff_len <= 8) __capabilities &= ~RPC_CAPABILITY_CHUNKED;
+        // CRCs are always sent so this only affects packets received from now on.
+        _skip_crc = __capabilities & RPC_CAPABILITY_NO_CRC;
+        __capabilities_response[0] = __capabilities;
+        __capabilities_response[1] = _buff_len;
+        __capabilities_response[2] = _mtu;
+        __capabilities_response[3] = _dictionary_id();
+        *out_data = (uint8_t *) __capabilities_response;
+        *out_data_len = sizeof(__capabilities_response);
+        return;
+    }
+
+    if ((command == _hash(_BATCH_COMMAND)) && (__capabilities & RPC_CAPABILITY_BATCH)) {
+        __dispatch_batch(data, size, out_data, out_data_len);
+        return;
+    }
+
+    if ((command == _hash(_DELTA_COMMAND)) && (__capabilities & RPC_CAPABILITY_DELTA)) {
+        __dispatch_delta(data, size, out_data, out_data_len);
+        return;
+    }
+
+    if ((command == _hash(_CONDITIONAL_COMMAND)) && (__capabilities & RPC_CAPABILITY_CONDITIONAL)) {
+        __dispatch_conditional(data, size, out_data, out_data_len);
+        return;
+    }
+
+    if ((command == _hash(_EVENTS_COMMAND)) && (__capabilities & RPC_CAPABILITY_EVENTS)) {
+        __dispatch_events(data, size, out_data, out_data_len);
+        return;
+    }
+
+    if ((command == _hash(_SUBSCRIBE_COMMAND)) && (__capabilities & RPC_CAPABILITY_SUBSCRIBE)) {
+        __dispatch_subscribe(data, size, out_data, out_data_len);
+        return;
+    }
+
+    for (size_t i = 0; i < __dict_alloced; i++) {
+        if ((__dict[i].key == command) && __dict[i].value) {
+            __dict[i].value(data, size, out_data, out_data_len);
+            break;
+        }
+    }
+}
+
+void rpc_slave::__dispatch_delta(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len)
+{
+    uint8_t *result = NULL;
+    size_t result_len = 0;
+    rpc_delta_entry_t *entry = NULL;
+    *out_data_len = 0;
+    if (size < 8) return;
+    uint32_t command = unpack_unsigned_long(data);
+    uint32_t tag = unpack_unsigned_long(data + 4);
+    if ((command == _hash(_BATCH_COMMAND)) || (command == _hash(_DELTA_COMMAND))
+    || (command == _hash(_CONDITIONAL_COMMAND))) return;
+    __dispatch(command, data + 8, size - 8, &result, &result_len);
+    if (_buff_len < (result_len + 1)) return;
+
+    for (size_t i = 0; (i < __delta_dict_alloced) && (!entry); i++) {
+        if (__delta_dict[i].key == command) entry = __delta_dict + i;
+    }
+
+    // The response is built at the end of _buff which __put_result() then moves into place.
+    // A delta has to be smaller than the full result so both fit the same space.
+    uint8_t *out = _buff + _buff_len - (result_len + 1);
+    bool apart = ((result + result_len) <= out) || (result >= (_buff + _buff_len));
+    size_t delta_len = 0;
+    bool delta = entry && entry->tag && (entry->tag == tag) && apart && (result_len > 9)
+              && xor_rle_encode(result, result_len, entry->data, entry->data_len, out + 9, result_len - 9, &delta_len);
+
+    if (delta) {
+        const uint32_t header[2] = {_tag(result, result_len), result_len};
+        out[0] = 1;
+        memcpy(out + 1, header, sizeof(header));
+        *out_data_len = 9 + delta_len;
+    }
+
+    // The slave's copy must be updated before the result below moves over it.
+    if (entry) {
+        bool fits = result_len <= entry->data_max;
+        if (fits && result_len) memcpy(entry->data, result, result_len);
+        entry->data_len = fits ? result_len : 0;
+        entry->tag = fits ? _tag(result, result_len) : 0;
+    }
+
+    if (!delta) {
+        if (result_len) memmove(out + 1, result, result_len);
+        out[0] = 0;
+        *out_data_len = result_len + 1;
+    }
+
+    *out_data = out;
+}
+
+void rpc_slave::__dispatch_conditional(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len)
+{
+    if (size < 8) return;
+    uint32_t command = unpack_unsigned_long(data);
+    uint32_t tag = unpack_unsigned_long(data + 4);
+    if ((command == _hash(_BATCH_COMMAND)) || (command == _hash(_DELTA_COMMAND))
+    || (command == _hash(_CONDITIONAL_COMMAND))) return;
+    __dispatch(command, data + 8, size - 8, out_data, out_data_len);
+    __not_modified = tag && (tag == _tag(*out_data, *out_data_len));
+    if (__not_modified) *out_data_len = 0;
+}
+
+// The result has to fit a fast result frame here and a data packet at the master. Until the master
+// says how big its buffer is only this side's is known.
+size_t rpc_slave::__event_room()
+{
+    size_t room = __peer_buff_len ? min(_buff_len, __peer_buff_len) : _buff_len;
+    return (room > 12) ? (room - 12) : 0;
+}
+
+void rpc_slave::__dispatch_events(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len)
+{
+    // Events go out straight from the queue and stay there until the next fetch acknowledges them.
+    size_t room = __event_room();
+    *out_data = __event_buff;
+    *out_data_len = 0;
+
+    // The master acknowledges a running count so a repeated fetch does not drop events twice.
+    if (size >= sizeof(uint32_t)) {
+        uint32_t ack = unpack_unsigned_long(data);
+        if ((ack - __events_acked) <= __event_count) __pop_events(ack - __events_acked);
+        __events_acked = ack;
+    }
+
+    // An event that can never be sent would block the queue forever.
+    while (__event_count && ((8 + unpack_unsigned_long(__event_buff + 4)) > room)) __pop_events(1);
+
+    for (size_t i = 0; i < __event_count; i++) {
+        size_t len = 8 + unpack_unsigned_long(__event_buff + *out_data_len + 4);
+        if ((*out_data_len + len) > room) break;
+        *out_data_len += len;
+    }
+}
+
+void rpc_slave::__dispatch_subscribe(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len)
+{
+    __subscribe_response[0] = 0;
+    *out_data = __subscribe_response;
+    *out_data_len = sizeof(__subscribe_response);
+    if (size < 8) return;
+    uint32_t command = unpack_unsigned_long(data);
+
+    for (size_t i = 0; (i < __dict_alloced) && (!__subscription_cb); i++) {
+        if (__dict[i].key == command) __subscription_cb = __dict[i].value;
+    }
+
+    if (!__subscription_cb) return;
+
+    // The args move to the end of _buff where the reply does not overwrite them. Streaming
+    // does not use _buff so they stay there for every run of the callback.
+    __subscription_args_len = size - 8;
+    __subscription_args = _buff + _buff_len - __subscription_args_len;
+    memmove(__subscription_args, data + 8, __subscription_args_len);
+    __subscription_period = unpack_unsigned_long(data + 4);
+    __subscription_last = millis() - __subscription_period;
+    __subscribe_response[0] = 1;
+}
+
+bool rpc_slave::_stream_writer_frame(rpc_stream_writer_callback_t callback, uint8_t **data, uint32_t *size)
+{
+    if (!__subscription_cb) return rpc::_stream_writer_frame(callback, data, size);
+    unsigned long elapsed = millis() - __subscription_last;
+    if (elapsed < __subscription_period) delay(__subscription_period - elapsed);
+    __subscription_last = millis();
+    size_t out_data_len = 0;
+    *data = NULL;
+    __subscription_cb(__subscription_args, __subscription_args_len, data, &out_data_len);
+    *size = out_data_len;
+    return true;
+}
+
+// Reserved commands would need the legacy exchange so only user callbacks are run.
+void rpc_slave::_stream_call(uint32_t command, uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len)
+{
+    *out_data = NULL;
+    *out_data_len = 0;
+
+    for (size_t i = 0; i < __dict_alloced; i++) {
+        if ((__dict[i].key == command) && __dict[i].value) {
+            __dict[i].value(data, size, out_data, out_data_len);
+            break;
+        }
+    }
+}
+
+void rpc_slave::__dispatch_batch(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len)
+{
+    // Results are gathered in _buff right after the batch entries which __put_result()
+    // then moves into place. Entries whose result does not fit come back empty and the
+    // list stops early once not even a length fits.
+    // The room left is also capped so the results still fit in a fast result frame.
+    uint8_t *out = data + size;
+    size_t room = min((size_t) ((_buff + _buff_len) - out), _buff_len - 12);
+    size_t offset = 0;
+    *out_data = out;
+    *out_data_len = 0;
+
+    while (((offset + 8) <= size) && (room >= sizeof(uint32_t))) {
+        uint32_t command = unpack_unsigned_long(data + offset);
+        uint32_t len = unpack_unsigned_long(data + offset + 4);
+        if ((size - offset - 8) < len) break;
+        uint8_t *result = NULL;
+        size_t result_len = 0;
+        if ((command != _hash(_BATCH_COMMAND)) && (command != _hash(_DELTA_COMMAND))
+        && (command != _hash(_CONDITIONAL_COMMAND)) && (command != _hash(_EVENTS_COMMAND))
+        && (command != _hash(_SUBSCRIBE_COMMAND))) {
+            __dispatch(command, data + offset + 8, len, &result, &result_len);
+        }
+        if ((room - sizeof(uint32_t)) < result_len) result_len = 0;
+        const uint32_t header[1] = {result_len};
+        memcpy(out, header, sizeof(header));
+        if (result_len) memmove(out + sizeof(header), result, result_len);
+        out += sizeof(header) + result_len;
+        room -= sizeof(header) + result_len;
+        *out_data_len += sizeof(header) + result_len;
+        offset += 8 + len;
+    }
+}
+
 void rpc_slave::loop(unsigned long send_timeout, unsigned long recv_timeout)
 {
     for (;;) {
@@ -548,16 +2953,21 @@ void rpc_slave::loop(unsigned long send_timeout, unsigned long recv_timeout)
         if (__get_command(&command, &data, &size, recv_timeout)) {
             uint8_t *out_data = NULL;
             size_t out_data_len = 0;
+            __not_modified = false;
+            __dispatch(command, data, size, &out_data, &out_data_len);
 
-            for (size_t i = 0; i < __dict_alloced; i++) {
-                if ((__dict[i].key == command) && __dict[i].value) {
-                    __dict[i].value(data, size, &out_data, &out_data_len);
-                    break;
-                }
+            bool sent = __put_result(out_data, out_data_len, send_timeout);
+            if (sent && __schedule_cb) __schedule_cb();
+            __schedule_cb = NULL;
+
+            // A subscription owns the link until the master stops reading the stream.
+            if (sent && __subscription_cb) {
+                stream_writer(NULL, send_timeout);
+                __fast = false;
+                __last_result_len = 0;
             }
 
-            if (__put_result(out_data, out_data_len, send_timeout) && __schedule_cb) __schedule_cb();
-            __schedule_cb = NULL;
+            __subscription_cb = NULL;
         }
 
         if (__loop_cb) __loop_cb();
@@ -569,6 +2979,7 @@ rpc_can_master::rpc_can_master(uint8_t *buff, size_t buff_len, long message_id,
     : rpc_master(buff, buff_len) 
 {
     __message_id = message_id;
+    _mtu = 8;
     CAN.begin(bit_rate);
     CAN.filter(message_id);
 }
@@ -580,6 +2991,7 @@ rpc_can_master::~rpc_can_master()
 
 void rpc_can_master::_flush()
 {
+    while (CAN.available()) CAN.read();
     for (int i = 0, ii = CAN.parsePacket(); i < ii; i++) CAN.read();
 }
 
@@ -588,11 +3000,10 @@ bool rpc_can_master::get_bytes(uint8_t *buff, size_t size, unsigned long timeout
     size_t i = 0;
     unsigned long start = millis();
 
+    // Bytes left in the current frame come first as the next parsePacket() drops them.
     while (((millis() - start) < timeout) && (i != size)) {
-        for (int j = 0, jj = CAN.parsePacket(); j < jj; j++) {
-            buff[i++] = CAN.read();
-            if (i == size) break;
-        }
+        if (!CAN.available()) CAN.parsePacket();
+        while (CAN.available() && (i != size)) buff[i++] = CAN.read();
     }
 
     bool ok = i == size;
@@ -600,6 +3011,12 @@ bool rpc_can_master::get_bytes(uint8_t *buff, size_t size, unsigned long timeout
     return ok;
 }
 
+// Parsing the next frame here is fine as get_bytes() reads what is left of it first.
+int rpc_can_master::_stream_available()
+{
+    return CAN.available() ? CAN.available() : CAN.parsePacket();
+}
+
 bool rpc_can_master::put_bytes(uint8_t *data, size_t size, unsigned long timeout)
 {
     size_t i = 0;
@@ -607,7 +3024,7 @@ bool rpc_can_master::put_bytes(uint8_t *data, size_t size, unsigned long timeout
 
     while (((millis() - start) < timeout) && (i != size)) {
         if (CAN.beginPacket(__message_id)) {
-            size_t sent = CAN.write(data + i, min(size - i, 8));
+            size_t sent = CAN.write(data + i, min(size - i, _mtu));
             if (CAN.endPacket()) i += sent;
         }
     }
@@ -621,6 +3038,7 @@ rpc_can_slave::rpc_can_slave(uint8_t *buff, size_t buff_len,
     : rpc_slave(buff, buff_len, callback_dict, callback_dict_len) 
 {
     __message_id = message_id;
+    _mtu = 8;
     CAN.begin(bit_rate);
     CAN.filter(message_id);
 }
@@ -632,6 +3050,7 @@ rpc_can_slave::~rpc_can_slave()
 
 void rpc_can_slave::_flush()
 {
+    while (CAN.available()) CAN.read();
     for (int i = 0, ii = CAN.parsePacket(); i < ii; i++) CAN.read();
 }
 
@@ -640,16 +3059,21 @@ bool rpc_can_slave::get_bytes(uint8_t *buff, size_t size, unsigned long timeout)
     size_t i = 0;
     unsigned long start = millis();
 
+    // Bytes left in the current frame come first as the next parsePacket() drops them.
     while (((millis() - start) < timeout) && (i != size)) {
-        for (int j = 0, jj = CAN.parsePacket(); j < jj; j++) {
-            buff[i++] = CAN.read();
-            if (i == size) break;
-        }
+        if (!CAN.available()) CAN.parsePacket();
+        while (CAN.available() && (i != size)) buff[i++] = CAN.read();
     }
 
     return i == size;
 }
 
+// Parsing the next frame here is fine as get_bytes() reads what is left of it first.
+int rpc_can_slave::_stream_available()
+{
+    return CAN.available() ? CAN.available() : CAN.parsePacket();
+}
+
 bool rpc_can_slave::put_bytes(uint8_t *data, size_t size, unsigned long timeout)
 {
     size_t i = 0;
@@ -657,7 +3081,7 @@ bool rpc_can_slave::put_bytes(uint8_t *data, size_t size, unsigned long timeout)
 
     while (((millis() - start) < timeout) && (i != size)) {
         if (CAN.beginPacket(__message_id)) {
-            size_t sent = CAN.write(data + i, min(size - i, 8));
+            size_t sent = CAN.write(data + i, min(size - i, _mtu));
             if (CAN.endPacket()) i += sent;
         }
     }
@@ -671,7 +3095,9 @@ rpc_i2c_master::rpc_i2c_master(uint8_t *buff, size_t buff_len, int slave_addr,
 {
     __slave_addr = slave_addr;
     __rate = rate;
+    _mtu = 32;
     _stream_writer_queue_depth_max = 1;
+    _pipeline_depth_max = 1;
 }
 
 void rpc_i2c_master::_flush()
@@ -687,10 +3113,10 @@ bool rpc_i2c_master::get_bytes(uint8_t *buff, size_t size, unsigned long timeout
     Wire.begin();
     Wire.setClock(__rate);
 
-    for (size_t i = 0; i < size; i += 32) {
+    for (size_t i = 0; i < size; i += _mtu) {
         size_t size_remaining = size - i;
-        size_t request_size = min(size_remaining, 32);
-        bool request_stop = size_remaining <= 32;
+        size_t request_size = min(size_remaining, _mtu);
+        bool request_stop = size_remaining <= _mtu;
         delayMicroseconds(100); // Give slave time to get ready.
         if (Wire.requestFrom(__slave_addr, request_size, request_stop) != request_size) { ok = false; break; }
         for (size_t j = 0; j < request_size; j++) buff[i+j] = Wire.read();
@@ -710,10 +3136,10 @@ bool rpc_i2c_master::put_bytes(uint8_t *data, size_t size, unsigned long timeout
     Wire.begin();
     Wire.setClock(__rate);
 
-    for (size_t i = 0; (i < size) && ok; i += 32) {
+    for (size_t i = 0; (i < size) && ok; i += _mtu) {
         size_t size_remaining = size - i;
-        size_t request_size = min(size_remaining, 32);
-        bool request_stop = size_remaining <= 32;
+        size_t request_size = min(size_remaining, _mtu);
+        bool request_stop = size_remaining <= _mtu;
         delayMicroseconds(100); // Give slave time to get ready.
         Wire.beginTransmission(__slave_addr);
         ok = (Wire.write(data + i, request_size) == request_size) && (!Wire.endTransmission(request_stop));
@@ -729,7 +3155,9 @@ rpc_i2c_slave::rpc_i2c_slave(uint8_t *buff, size_t buff_len,
     : rpc_slave(buff, buff_len, callback_dict, callback_dict_len) 
 {
     __slave_addr = slave_addr;
+    _mtu = 32;
     _stream_writer_queue_depth_max = 1;
+    _pipeline_depth_max = 1;
 }
 
 void rpc_i2c_slave::_flush()
@@ -759,7 +3187,7 @@ bool rpc_i2c_slave::put_bytes(uint8_t *data, size_t size, unsigned long timeout)
     size_t i = 0;
     unsigned long start = millis();
 
-    while (((millis() - start) < timeout) && (i < size)) i += Wire.write(data + i, min(size - i, 32));
+    while (((millis() - start) < timeout) && (i < size)) i += Wire.write(data + i, min(size - i, _mtu));
 
     Wire.end();
     return i == size;
@@ -774,6 +3202,7 @@ rpc_spi_master::rpc_spi_master(uint8_t *buff, size_t buff_len,
     __settings = SPISettings(freq, MSBFIRST, spi_mode);
     SPI.begin();
     _stream_writer_queue_depth_max = 1;
+    _pipeline_depth_max = 1;
 }
 
 rpc_spi_master::~rpc_spi_master()
@@ -17,15 +17,83 @@ namespace openmv {
 
 typedef void (*rpc_callback_t)(uint8_t *in_data, size_t in_data_len, uint8_t **out_data, size_t *out_data_len);
 typedef void (*rpc_plain_callback_t)();
+typedef void (*rpc_chunk_callback_t)(uint8_t *data, size_t data_len, uint32_t offset, uint32_t total_len);
+typedef void (*rpc_event_callback_t)(uint8_t *data, size_t data_len);
 
 typedef struct rpc_callback_entry {
     uint32_t key;
     rpc_callback_t value;
 } rpc_callback_entry_t;
 
+typedef struct rpc_chunk_callback_entry {
+    uint32_t key;
+    rpc_chunk_callback_t value;
+} rpc_chunk_callback_entry_t;
+
+typedef struct rpc_event_callback_entry {
+    uint32_t key;
+    rpc_event_callback_t value;
+} rpc_event_callback_entry_t;
+
+typedef struct rpc_delta_entry {
+    uint32_t key;
+    uint8_t *data;
+    size_t data_max;
+    size_t data_len;
+    uint32_t tag;
+} rpc_delta_entry_t;
+
+typedef struct rpc_cache_entry {
+    uint32_t key;
+    uint8_t *data; // args followed by the result
+    size_t data_max;
+    size_t data_len;
+    size_t args_len;
+    unsigned long ttl;
+    unsigned long stamp;
+    bool valid;
+} rpc_cache_entry_t;
+
+typedef enum rpc_capability {
+    RPC_CAPABILITY_FAST_CALL = 0x00000001, // Header and payload travel in one frame each way.
+    RPC_CAPABILITY_PIPELINE = 0x00000002, // Sequence numbered fast frames with many in flight.
+    RPC_CAPABILITY_BATCH = 0x00000004, // Many commands packed into one call.
+    RPC_CAPABILITY_CHUNKED = 0x00000008, // Payloads larger than either buffer move in chunks.
+    RPC_CAPABILITY_NAK = 0x00000010, // Corrupt data packets are resent without redoing the header.
+    RPC_CAPABILITY_FRAGMENTS = 0x00000020, // Data packets split into MTU aligned fragments with their own CRC.
+    RPC_CAPABILITY_ACKLESS = 0x00000040, // Both transports are reliable so calls are one write and one read.
+    RPC_CAPABILITY_NO_CRC = 0x00000080, // Both transports guarantee integrity so CRCs are not checked.
+    RPC_CAPABILITY_COMPRESSION = 0x00000100, // Data packets are compressed when that shrinks them.
+    RPC_CAPABILITY_DELTA = 0x00000200, // Results are sent as a delta against the master's last copy.
+    RPC_CAPABILITY_CONDITIONAL = 0x00000400, // Unchanged results are answered with "not modified".
+    RPC_CAPABILITY_EVENTS = 0x00000800, // The slave queues events which the master fetches in one call.
+    RPC_CAPABILITY_SUBSCRIBE = 0x00001000, // Results of a command are streamed at a period.
+    RPC_CAPABILITY_ALL = 0xFFFFFFFF
+} rpc_capability_t;
+
+typedef enum rpc_transport {
+    RPC_TRANSPORT_RELIABLE = 0x00000001, // Bytes are never lost, duplicated or reordered (e.g. TCP).
+    RPC_TRANSPORT_INTEGRITY = 0x00000002 // Bytes are never corrupted (e.g. shared memory).
+} rpc_transport_t;
+
 typedef void (*rpc_stream_reader_callback_t)(uint8_t *in_data, uint32_t in_data_len);
 typedef void (*rpc_stream_writer_callback_t)(uint8_t **out_data, uint32_t *out_data_len);
 
+typedef struct rpc_stream_fragment {
+    uint8_t *data;
+    uint32_t len;
+} rpc_stream_fragment_t;
+
+typedef void (*rpc_stream_gather_callback_t)(rpc_stream_fragment_t **out_fragments, size_t *out_fragments_len);
+
+typedef struct rpc_stream_channel {
+    rpc_stream_reader_callback_t reader;
+    rpc_stream_writer_callback_t writer;
+    unsigned long queue_depth;
+    unsigned long credits;
+    uint8_t lfsr;
+} rpc_stream_channel_t;
+
 class rpc
 {
 public:
@@ -33,13 +101,84 @@ public:
     ~rpc() {}
     virtual bool get_bytes(uint8_t *buff, size_t size, unsigned long timeout) = 0;
     virtual bool put_bytes(uint8_t *data, size_t size, unsigned long timeout) = 0;
-    void stream_reader(rpc_stream_reader_callback_t callback, unsigned long queue_depth = 1, unsigned long read_timeout = 5000);
+    // With more than one buffer _buff is split into that many slices, the credit for a frame goes back
+    // before its callback runs and each frame stays valid until buffers - 1 more frames arrived.
+    void stream_reader(rpc_stream_reader_callback_t callback, unsigned long queue_depth = 1, unsigned long read_timeout = 5000,
+                       unsigned long buffers = 1);
     void stream_writer(rpc_stream_writer_callback_t callback, unsigned long write_timeout = 5000);
+    // Sends each frame as the concatenation of the fragments returned without copying them (same reader).
+    void stream_writer_gather(rpc_stream_gather_callback_t callback, unsigned long write_timeout = 5000);
+    // Both sides must pass the same number of channels (up to 256) in the same order.
+    void stream_reader_channels(rpc_stream_channel_t *channels, size_t channels_len, unsigned long read_timeout = 5000);
+    void stream_writer_channels(rpc_stream_channel_t *channels, size_t channels_len, unsigned long write_timeout = 5000);
+    // Both sides run this with the same channels to stream both ways at once on a full duplex link.
+    // Channels with a reader grant queue_depth credits to the peer, channels with a writer send.
+    // timeout bounds the setup, each frame and credit and the wait for the peer while nothing can be sent.
+    void stream_duplex(rpc_stream_channel_t *channels, size_t channels_len, unsigned long timeout = 5000);
+    // Makes stream_reader() ask for sequenced frames so that the stream survives corruption and timeouts.
+    // Frames lost that way are not resent but counted in get_stream_dropped(). Writers follow the reader.
+    // Off by default as OpenMV cameras only know the legacy stream.
+    void set_stream_resumable(bool resumable) { __stream_resumable = resumable; }
+    // Credit window of the current or last stream. Resumable streams tune it between 1 and queue_depth.
+    unsigned long get_stream_window() { return __stream_window; }
+    // Makes stream_reader() ask for a resumable stream with one frame in flight where the writer keeps
+    // replacing its frame with a newer one until it may send it.
+    void set_stream_latest_only(bool latest_only) { __stream_latest_only = latest_only; }
+    // Frames of the current or last resumable stream that the writer replaced or that were lost.
+    unsigned long get_stream_dropped() { return __stream_dropped; }
+    // Writer side. In resumable streams frames are packed into batches of up to batch_len bytes (which
+    // must fit the reader's buffer) gathered for at most batch_delay ms (0 waits for a full batch).
+    // The reader unpacks them.
+    void set_stream_coalescing(size_t batch_len, unsigned long batch_delay = 0);
+    // Reader side. Frames bigger than the buffer (or its slice) are passed to callback one buffer at a
+    // time instead of ending the stream. A resumable frame whose CRC then fails is not finished and
+    // the next frame starts again at offset 0.
+    void set_stream_chunk_callback(rpc_chunk_callback_t callback) { __stream_chunk_callback = callback; }
+    // Writer side. Limits streams to bytes_per_second (headers included) and frames_per_second where 0
+    // is no limit. The writer may run up to burst_ms ahead of the target before it waits.
+    void set_stream_pacing(unsigned long bytes_per_second, unsigned long frames_per_second = 0, unsigned long burst_ms = 0);
+    // Throughput of the current or last stream on this side, headers included.
+    unsigned long get_stream_bytes_per_second();
+    unsigned long get_stream_frames_per_second();
+    // Must be the same on both sides and set before negotiate().
+    void set_compression_dictionary(const uint8_t *dictionary, size_t dictionary_len);
 protected:
     const uint16_t _COMMAND_HEADER_PACKET_MAGIC = 0x1209;
     const uint16_t _COMMAND_DATA_PACKET_MAGIC = 0xABD1;
     const uint16_t _RESULT_HEADER_PACKET_MAGIC = 0x9021;
     const uint16_t _RESULT_DATA_PACKET_MAGIC = 0x1DBA;
+    const uint16_t _FAST_COMMAND_PACKET_MAGIC = 0x3E51;
+    const uint16_t _FAST_RESULT_PACKET_MAGIC = 0x513E;
+    const uint16_t _PIPELINED_COMMAND_PACKET_MAGIC = 0x7C4D;
+    const uint16_t _PIPELINED_RESULT_PACKET_MAGIC = 0x4D7C;
+    const uint16_t _COMMAND_CHUNK_PACKET_MAGIC = 0x2C6B;
+    const uint16_t _RESULT_CHUNK_PACKET_MAGIC = 0x6B2C;
+    const uint16_t _NAK_PACKET_MAGIC = 0xA55A;
+    const uint16_t _FRAGMENT_PACKET_MAGIC = 0xF46A;
+    const uint16_t _STREAM_CHANNEL_SETUP_MAGIC = 0xEDF7;
+    const uint16_t _STREAM_CHANNEL_FRAME_MAGIC = 0x542F;
+    const uint16_t _STREAM_RESUME_SETUP_MAGIC = 0xEDF8;
+    const uint16_t _STREAM_RESUME_FRAME_MAGIC = 0x5430;
+    const uint16_t _STREAM_RESUME_ACK_MAGIC = 0x3054;
+    const uint16_t _STREAM_DUPLEX_SETUP_MAGIC = 0xEDF9;
+    const uint16_t _STREAM_DUPLEX_FRAME_MAGIC = 0x5431;
+    const uint16_t _STREAM_DUPLEX_CREDIT_MAGIC = 0x3154;
+    const uint16_t _STREAM_CALL_MAGIC = 0x3255;
+    const uint16_t _STREAM_RESULT_MAGIC = 0x5532;
+    const uint32_t _CAPABILITIES = RPC_CAPABILITY_FAST_CALL | RPC_CAPABILITY_PIPELINE | RPC_CAPABILITY_BATCH |
+                                   RPC_CAPABILITY_CHUNKED | RPC_CAPABILITY_NAK | RPC_CAPABILITY_FRAGMENTS |
+                                   RPC_CAPABILITY_ACKLESS | RPC_CAPABILITY_NO_CRC | RPC_CAPABILITY_COMPRESSION |
+                                   RPC_CAPABILITY_DELTA | RPC_CAPABILITY_CONDITIONAL | RPC_CAPABILITY_EVENTS |
+                                   RPC_CAPABILITY_SUBSCRIBE;
+    const uint32_t _COMPRESSED_LENGTH = 0x80000000;
+    const uint32_t _NOT_MODIFIED_LENGTH = 0x40000000;
+    const uint32_t _BATCHED_LENGTH = 0x80000000;
+    const char *_CAPABILITIES_COMMAND = "__rpc_capabilities";
+    const char *_BATCH_COMMAND = "__rpc_batch";
+    const char *_DELTA_COMMAND = "__rpc_delta";
+    const char *_CONDITIONAL_COMMAND = "__rpc_conditional";
+    const char *_EVENTS_COMMAND = "__rpc_events";
+    const char *_SUBSCRIBE_COMMAND = "__rpc_subscribe";
     const unsigned long _put_long_timeout = 5000;
     const unsigned long _get_long_timeout = 5000;
     unsigned long _put_short_timeout;
@@ -49,17 +188,84 @@ protected:
     uint32_t _hash(const __FlashStringHelper *name);
     uint32_t _hash(const char *name, size_t length);
     uint32_t _hash(const char *name);
+    size_t _chunk_size(size_t peer_buff_len) { return min(_buff_len, peer_buff_len) - 8; }
+    bool _check_packet(uint16_t magic_value, uint8_t *buff, size_t size);
     bool _get_packet(uint16_t magic_value, uint8_t *buff, size_t size, unsigned long timeout);
     void _set_packet(uint8_t *buff, uint16_t magic_value, uint8_t *data, size_t size);
+    size_t _fragment_size(size_t size);
+    uint32_t _transport_capabilities();
+    uint32_t _tag(const uint8_t *data, size_t size);
+    uint32_t _dictionary_id() { return _tag(_dictionary, _dictionary_len); }
+    bool _compress(uint8_t **data, size_t *size, uint8_t *out, size_t peer_buff_len);
+    bool _decompress(uint8_t *data, size_t *size);
+    bool _put_fragments(size_t size, unsigned long timeout);
+    bool _get_fragments(size_t size, unsigned long timeout);
     virtual void _flush() {}
     virtual bool _stream_get_bytes(uint8_t *buff, size_t size, unsigned long timeout);
+    // Bytes that can be read right away or -1 when the transport cannot tell.
+    virtual int _stream_available() { return -1; }
     virtual bool _stream_put_bytes(uint8_t *data, size_t size, unsigned long timeout);
+    // Transports that can write many buffers in one go (e.g. writev()) should override this.
+    virtual bool _stream_put_gather(uint8_t *header, size_t header_len,
+                                    const rpc_stream_fragment_t *fragments, size_t fragments_len, unsigned long timeout);
+    virtual bool _stream_writer_frame(rpc_stream_writer_callback_t callback, uint8_t **data, uint32_t *size);
+    virtual size_t _stream_writer_room() { return _buff_len; }
+    // Answers calls that arrive on the reverse path of a resumable stream (see rpc_master::stream_call()).
+    virtual void _stream_call(uint32_t command, uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len);
+    bool _stream_put_call(uint32_t command, uint8_t *data, size_t size, rpc_stream_reader_callback_t callback);
     uint8_t *_buff;
     size_t _buff_len;
     unsigned long _stream_writer_queue_depth_max;
+    unsigned long _pipeline_depth_max;
+    size_t _mtu; // Largest write the transport makes at once (0 for no limit).
+    size_t _peer_mtu;
+    uint32_t _transport; // rpc_transport_t guarantees set by transports that have them.
+    bool _skip_crc;
+    const uint8_t *_dictionary;
+    size_t _dictionary_len;
+    bool _dictionary_shared;
 private:
     rpc(const rpc &);
-    uint16_t __crc_16(uint8_t *data, size_t size);
+    bool __stream_resumable;
+    unsigned long __stream_window;
+    bool __stream_latest_only;
+    unsigned long __stream_dropped;
+    size_t __stream_batch_len;
+    unsigned long __stream_batch_delay;
+    rpc_chunk_callback_t __stream_chunk_callback;
+    unsigned long __stream_pace_bytes;
+    unsigned long __stream_pace_frames;
+    unsigned long __stream_pace_burst;
+    unsigned long __stream_bytes_tat;
+    unsigned long __stream_frames_tat;
+    unsigned long __stream_start;
+    unsigned long __stream_last;
+    unsigned long __stream_bytes;
+    unsigned long __stream_frames;
+    bool __stream_active;
+    uint32_t __stream_call_command;
+    uint16_t __stream_call_id;
+    rpc_stream_reader_callback_t __stream_call_callback;
+    uint16_t __crc_16(uint8_t *data, size_t size, uint16_t crc = 0xFFFF);
+    bool __stream_sync(uint16_t magic_value, uint8_t *packet, size_t size, unsigned long timeout, size_t have = 0,
+                       uint16_t alt_magic_value = 0);
+    bool __stream_put_ack(uint16_t sequence, bool resume);
+    bool __stream_poll(uint8_t *packet, size_t size, bool guess);
+    void __stream_get_result(uint8_t *packet, uint8_t *buff, size_t buff_len, unsigned long timeout);
+    bool __stream_answer_call(uint8_t *packet, unsigned long timeout);
+    void __stream_begin();
+    void __stream_count(size_t size);
+    void __stream_pace(size_t size);
+    bool __stream_get_chunks(uint8_t *buff, size_t buff_len, uint32_t size, unsigned long timeout, uint16_t *crc);
+    void __stream_reader_resumable(rpc_stream_reader_callback_t callback, unsigned long queue_depth, unsigned long read_timeout,
+                                   unsigned long buffers, size_t slice_len);
+    void __stream_writer(rpc_stream_writer_callback_t callback, rpc_stream_gather_callback_t gather_callback,
+                         unsigned long write_timeout);
+    bool __stream_writer_fetch(rpc_stream_writer_callback_t callback, rpc_stream_gather_callback_t gather_callback,
+                               rpc_stream_fragment_t *frame, rpc_stream_fragment_t **fragments, size_t *fragments_len);
+    void __put_fragment_list(size_t size, uint32_t list);
+    bool __lz_compress(uint8_t *data, size_t size, uint8_t *out, size_t out_max, size_t *out_size, size_t *gap);
+    bool __lz_decompress(uint8_t *data, size_t size, uint8_t *out, size_t *out_size);
 };
 
 class rpc_master : public rpc
@@ -109,6 +315,105 @@ public:
               void *command_data, size_t command_data_len,
               void *result_data=NULL, size_t result_data_len=0, bool return_false_if_received_data_is_zero=true,
               unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    // Like call() but the result goes to result_callback as (data, len, offset, total) pieces instead of
+    // being returned. Results larger than either buffer arrive in many pieces in order, others in one.
+    bool call_chunked(const __FlashStringHelper *name,
+                      void *command_data, size_t command_data_len, rpc_chunk_callback_t result_callback,
+                      unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool call_chunked(const String &name,
+                      void *command_data, size_t command_data_len, rpc_chunk_callback_t result_callback,
+                      unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool call_chunked(const char *name,
+                      void *command_data, size_t command_data_len, rpc_chunk_callback_t result_callback,
+                      unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool negotiate(uint32_t capabilities=RPC_CAPABILITY_ALL,
+                   unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    uint32_t get_capabilities() { return __capabilities; }
+    bool call_pipelined(const __FlashStringHelper *name,
+                        void *command_data=NULL, size_t command_data_len=0, uint16_t *seq=NULL,
+                        unsigned long send_timeout=1000);
+    bool call_pipelined(const String &name,
+                        void *command_data=NULL, size_t command_data_len=0, uint16_t *seq=NULL,
+                        unsigned long send_timeout=1000);
+    bool call_pipelined(const char *name,
+                        void *command_data=NULL, size_t command_data_len=0, uint16_t *seq=NULL,
+                        unsigned long send_timeout=1000);
+    bool get_pipelined_result(uint16_t *seq, void **result_data=NULL, size_t *result_data_len=NULL,
+                              unsigned long recv_timeout=1000);
+    void set_pipeline_depth(unsigned long depth) { __pipeline_depth = max(depth, 1); }
+    unsigned long get_pipeline_depth() { return min(__pipeline_depth, _pipeline_depth_max); }
+    unsigned long get_pipeline_outstanding() { return __pipeline_outstanding; }
+    // Batches are built in the packet buffer so no other call may run between batch_begin() and the last
+    // batch_result(). One that does discards the batch and batch_call() or batch_result() return false.
+    void batch_begin();
+    bool batch_add(const __FlashStringHelper *name, void *command_data=NULL, size_t command_data_len=0);
+    bool batch_add(const String &name, void *command_data=NULL, size_t command_data_len=0);
+    bool batch_add(const char *name, void *command_data=NULL, size_t command_data_len=0);
+    bool batch_call(unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool batch_result(size_t index, void **result_data, size_t *result_data_len);
+    size_t batch_count() { return __batch_count; }
+    // result_data holds the last result on entry (result_data_len bytes) and is updated in place.
+    bool call_delta(const __FlashStringHelper *name,
+                    void *command_data, size_t command_data_len,
+                    void *result_data, size_t *result_data_len, size_t result_data_max,
+                    unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool call_delta(const String &name,
+                    void *command_data, size_t command_data_len,
+                    void *result_data, size_t *result_data_len, size_t result_data_max,
+                    unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool call_delta(const char *name,
+                    void *command_data, size_t command_data_len,
+                    void *result_data, size_t *result_data_len, size_t result_data_max,
+                    unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    // Like call_delta() but an unchanged result leaves result_data alone and sets modified to false.
+    bool call_conditional(const __FlashStringHelper *name,
+                          void *command_data, size_t command_data_len,
+                          void *result_data, size_t *result_data_len, size_t result_data_max, bool *modified=NULL,
+                          unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool call_conditional(const String &name,
+                          void *command_data, size_t command_data_len,
+                          void *result_data, size_t *result_data_len, size_t result_data_max, bool *modified=NULL,
+                          unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool call_conditional(const char *name,
+                          void *command_data, size_t command_data_len,
+                          void *result_data, size_t *result_data_len, size_t result_data_max, bool *modified=NULL,
+                          unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    void set_cache_dict(rpc_cache_entry_t *cache_dict, size_t cache_dict_len);
+    bool register_cache(const __FlashStringHelper *name, void *buff, size_t buff_len, unsigned long ttl);
+    bool register_cache(const String &name, void *buff, size_t buff_len, unsigned long ttl);
+    bool register_cache(const char *name, void *buff, size_t buff_len, unsigned long ttl);
+    void invalidate_cache();
+    unsigned long get_cache_hits() { return __cache_hits; }
+    unsigned long get_cache_misses() { return __cache_misses; }
+    void reset_cache_stats() { __cache_hits = 0; __cache_misses = 0; }
+    void set_event_callback_dict(rpc_event_callback_entry_t *event_callback_dict, size_t event_callback_dict_len);
+    bool register_event_callback(const __FlashStringHelper *name, rpc_event_callback_t callback);
+    bool register_event_callback(const String &name, rpc_event_callback_t callback);
+    bool register_event_callback(const char *name, rpc_event_callback_t callback);
+    // With an event pin wired to the slave's event pin events_pending() is a cheap check before poll_events().
+    void set_event_pin(long event_pin) { __event_pin = event_pin; if (__event_pin >= 0) pinMode(__event_pin, INPUT); }
+    bool events_pending() { return (__event_pin < 0) || (digitalRead(__event_pin) == HIGH); }
+    // Fetches once and runs the callbacks of the events returned. Call again while events_pending() for the rest.
+    bool poll_events(unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    // Streams the results of name run every period ms to callback until the stream stops.
+    bool subscribe(const __FlashStringHelper *name, void *command_data, size_t command_data_len, unsigned long period,
+                   rpc_stream_reader_callback_t callback, unsigned long queue_depth=1, unsigned long read_timeout=5000,
+                   unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool subscribe(const String &name, void *command_data, size_t command_data_len, unsigned long period,
+                   rpc_stream_reader_callback_t callback, unsigned long queue_depth=1, unsigned long read_timeout=5000,
+                   unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    bool subscribe(const char *name, void *command_data, size_t command_data_len, unsigned long period,
+                   rpc_stream_reader_callback_t callback, unsigned long queue_depth=1, unsigned long read_timeout=5000,
+                   unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    // Only from inside the callback of a resumable stream_reader() or subscribe(). The call goes out on the
+    // ack path and its result comes back ahead of the next frame to result_callback. A new call replaces
+    // one still waiting for its result, which is then dropped.
+    bool stream_call(const __FlashStringHelper *name, void *command_data, size_t command_data_len,
+                     rpc_stream_reader_callback_t result_callback);
+    bool stream_call(const String &name, void *command_data, size_t command_data_len,
+                     rpc_stream_reader_callback_t result_callback);
+    bool stream_call(const char *name, void *command_data, size_t command_data_len,
+                     rpc_stream_reader_callback_t result_callback);
 protected:
     const unsigned long _put_short_timeout_reset = 3;
     const unsigned long _get_short_timeout_reset = 3;
@@ -119,8 +424,50 @@ private:
     uint8_t __out_result_header_ack[4];
     uint8_t __in_result_header_buf[8];
     uint8_t __out_result_data_ack[4];
+    uint8_t __out_result_data_nak[12];
+    uint32_t __capabilities = 0;
+    size_t __peer_buff_len = 0;
+    unsigned long __pipeline_depth = 4;
+    unsigned long __pipeline_outstanding = 0;
+    uint16_t __pipeline_seq = 0;
+    size_t __batch_count = 0;
+    size_t __batch_size = 0;
+    uint8_t *__batch_result = NULL;
+    size_t __batch_result_size = 0;
+    bool __not_modified = false;
+    rpc_cache_entry_t *__cache_dict = NULL;
+    size_t __cache_dict_len = 0;
+    size_t __cache_dict_alloced = 0;
+    unsigned long __cache_hits = 0;
+    unsigned long __cache_misses = 0;
+    rpc_event_callback_entry_t *__event_dict = NULL;
+    size_t __event_dict_len = 0;
+    size_t __event_dict_alloced = 0;
+    long __event_pin = -1;
+    uint32_t __events_received = 0;
     bool __put_command(uint32_t command, uint8_t *data, size_t size, unsigned long timeout);
-    bool __get_result(uint8_t **data, size_t *size, unsigned long timeout);
+    bool __get_result(uint8_t **data, size_t *size, unsigned long timeout, rpc_chunk_callback_t callback=NULL);
+    bool __chunked(size_t size);
+    bool __fragmented(size_t size);
+    bool __put_command_chunks(uint8_t *data, size_t size, unsigned long timeout);
+    bool __get_result_chunks(uint32_t size, rpc_chunk_callback_t callback, unsigned long timeout);
+    size_t __set_fast_frame(uint32_t command, uint8_t *data, size_t size);
+    bool __fast_call(uint32_t command, uint8_t *data, size_t size, uint8_t **result, size_t *result_size,
+                     unsigned long send_timeout, unsigned long recv_timeout);
+    bool __call(uint32_t command, uint8_t *data, size_t size, uint8_t **result, size_t *result_size,
+                unsigned long send_timeout, unsigned long recv_timeout);
+    bool __put_pipelined_command(uint32_t command, uint8_t *data, size_t size, uint16_t *seq, unsigned long timeout);
+    void __batch_end(uint32_t command);
+    bool __batch_add(uint32_t command, uint8_t *data, size_t size);
+    bool __call_delta(uint32_t command, uint8_t *data, size_t size, uint8_t *result, size_t *result_size, size_t result_max,
+                      unsigned long send_timeout, unsigned long recv_timeout);
+    bool __register_cache(uint32_t command, void *buff, size_t buff_len, unsigned long ttl);
+    bool __register_event_callback(uint32_t event, rpc_event_callback_t callback);
+    bool __subscribe(uint32_t command, uint8_t *data, size_t size, unsigned long period,
+                     rpc_stream_reader_callback_t callback, unsigned long queue_depth, unsigned long read_timeout,
+                     unsigned long send_timeout, unsigned long recv_timeout);
+    bool __call_conditional(uint32_t command, uint8_t *data, size_t size, uint8_t *result, size_t *result_size, size_t result_max,
+                            bool *modified, unsigned long send_timeout, unsigned long recv_timeout);
 };
 
 class rpc_slave : public rpc
@@ -129,26 +476,85 @@ public:
     rpc_slave(uint8_t *buff, size_t buff_len, rpc_callback_entry_t *callback_dict, size_t callback_dict_len);
     ~rpc_slave() {}
     bool register_callback(const char *name, rpc_callback_t callback);
+    void set_chunk_callback_dict(rpc_chunk_callback_entry_t *chunk_callback_dict, size_t chunk_callback_dict_len);
+    // Commands larger than either buffer are passed to the chunk callback of the same name piece by
+    // piece in order. The regular callback then runs with no data (0 bytes) to produce the result.
+    // Needs set_chunk_callback_dict() first.
+    bool register_chunk_callback(const char *name, rpc_chunk_callback_t callback);
+    void set_delta_dict(rpc_delta_entry_t *delta_dict, size_t delta_dict_len);
+    bool register_delta_buffer(const char *name, void *buff, size_t buff_len);
+    void set_event_buffer(uint8_t *event_buff, size_t event_buff_len);
+    void set_event_pin(long event_pin);
+    // Returns false if the event does not fit the free event buffer or is too big to ever be fetched.
+    bool push_event(const char *name, void *data=NULL, size_t data_len=0);
+    size_t get_events_queued() { return __event_count; }
     void schedule_callback(rpc_plain_callback_t callback);
     void setup_loop_callback(rpc_plain_callback_t callback);
     void loop(unsigned long send_timeout=1000, unsigned long recv_timeout=1000);
+    void set_capabilities(uint32_t capabilities) { __capabilities_offered = capabilities; }
+    uint32_t get_capabilities() { return __capabilities; }
 protected:
     const unsigned long _put_short_timeout_reset = 2;
     const unsigned long _get_short_timeout_reset = 2;
+    virtual bool _stream_writer_frame(rpc_stream_writer_callback_t callback, uint8_t **data, uint32_t *size) override;
+    // Subscription args live at the end of _buff.
+    virtual size_t _stream_writer_room() override { return _buff_len - (__subscription_cb ? __subscription_args_len : 0); }
+    virtual void _stream_call(uint32_t command, uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len) override;
 private:
     rpc_slave(const rpc_slave &);
     rpc_callback_entry_t *__dict;
     size_t __dict_len;
     size_t __dict_alloced = 0;
+    rpc_chunk_callback_entry_t *__chunk_dict = NULL;
+    size_t __chunk_dict_len = 0;
+    size_t __chunk_dict_alloced = 0;
+    rpc_delta_entry_t *__delta_dict = NULL;
+    size_t __delta_dict_len = 0;
+    size_t __delta_dict_alloced = 0;
+    uint8_t *__event_buff = NULL;
+    size_t __event_buff_len = 0;
+    size_t __event_size = 0;
+    size_t __event_count = 0;
+    uint32_t __events_acked = 0;
+    long __event_pin = -1;
+    rpc_callback_t __subscription_cb = NULL;
+    uint8_t *__subscription_args = NULL;
+    size_t __subscription_args_len = 0;
+    unsigned long __subscription_period = 0;
+    unsigned long __subscription_last = 0;
+    uint8_t __subscribe_response[1];
     rpc_plain_callback_t __schedule_cb = NULL;
     rpc_plain_callback_t __loop_cb = NULL;
     uint8_t __in_command_header_buf[12];
     uint8_t __out_command_header_ack[4];
     uint8_t __out_command_data_ack[4];
+    uint8_t __out_command_data_nak[4];
+    uint8_t __out_fast_command_nak[8];
     uint8_t __in_response_header_buf[4];
     uint8_t __in_response_data_buf[4];
+    uint32_t __capabilities_offered = RPC_CAPABILITY_ALL;
+    uint32_t __capabilities = 0;
+    uint32_t __capabilities_response[4];
+    size_t __peer_buff_len = 0;
+    bool __fast;
+    bool __pipelined;
+    uint16_t __seq;
+    size_t __last_result_len;
+    bool __not_modified;
     bool __get_command(uint32_t *command, uint8_t **data, size_t *size, unsigned long timeout);
     bool __put_result(uint8_t *data, size_t size, unsigned long timeout);
+    bool __chunked(size_t size);
+    bool __fragmented(size_t size);
+    bool __get_command_chunks(uint32_t command, uint32_t size, unsigned long timeout);
+    bool __put_result_chunks(uint8_t *data, size_t size, unsigned long timeout);
+    void __dispatch(uint32_t command, uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len);
+    void __dispatch_batch(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len);
+    void __dispatch_delta(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len);
+    void __dispatch_conditional(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len);
+    size_t __event_room();
+    void __dispatch_events(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len);
+    void __dispatch_subscribe(uint8_t *data, size_t size, uint8_t **out_data, size_t *out_data_len);
+    void __pop_events(size_t count);
 };
 
 class rpc_can_master : public rpc_master
@@ -160,6 +566,7 @@ public:
     virtual void _flush() override;
     virtual bool get_bytes(uint8_t *buff, size_t size, unsigned long timeout) override;
     virtual bool put_bytes(uint8_t *data, size_t size, unsigned long timeout) override;
+    virtual int _stream_available() override;
     void set_message_id(long message_id) { __message_id = message_id; }
     long get_message_id() { return __message_id; }
 private:
@@ -177,6 +584,7 @@ public:
     virtual void _flush() override;
     virtual bool get_bytes(uint8_t *buff, size_t size, unsigned long timeout) override;
     virtual bool put_bytes(uint8_t *data, size_t size, unsigned long timeout) override;
+    virtual int _stream_available() override;
     void set_message_id(long message_id) { __message_id = message_id; }
     long get_message_id() { return __message_id; }
 private:
@@ -242,6 +650,7 @@ public: \
     virtual void _flush() override; \
     virtual bool get_bytes(uint8_t *buff, size_t size, unsigned long timeout) override; \
     virtual bool put_bytes(uint8_t *data, size_t size, unsigned long timeout) override; \
+    virtual int _stream_available() override { return Serial##name.available(); } \
 private: \
     rpc_hardware_serial##name##_uart_master(const rpc_hardware_serial##name##_uart_master &); \
 };
@@ -277,6 +686,7 @@ public: \
     virtual void _flush() override; \
     virtual bool get_bytes(uint8_t *buff, size_t size, unsigned long timeout) override; \
     virtual bool put_bytes(uint8_t *data, size_t size, unsigned long timeout) override; \
+    virtual int _stream_available() override { return Serial##name.available(); } \
 private: \
     rpc_hardware_serial##name##_uart_slave(const rpc_hardware_serial##name##_uart_slave &); \
 };
@@ -310,6 +720,7 @@ public:
     virtual void _flush() override;
     virtual bool get_bytes(uint8_t *buff, size_t size, unsigned long timeout) override;
     virtual bool put_bytes(uint8_t *data, size_t size, unsigned long timeout) override;
+    virtual int _stream_available() override { __serial.listen(); return __serial.available(); }
 private:
     SoftwareSerial __serial;
     rpc_software_serial_uart_master(const rpc_software_serial_uart_master &);   
@@ -325,6 +736,7 @@ public:
     virtual void _flush() override;
     virtual bool get_bytes(uint8_t *buff, size_t size, unsigned long timeout) override;
     virtual bool put_bytes(uint8_t *data, size_t size, unsigned long timeout) override;
+    virtual int _stream_available() override { __serial.listen(); return __serial.available(); }
 private:
     SoftwareSerial __serial;
     rpc_software_serial_uart_slave(const rpc_software_serial_uart_slave &);   